@@ -14,9 +14,28 @@
 #include <set>
 #include <unordered_set>
 #include <stack>
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <bitset>
+#include <cstring>
+#include <cstdint>
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#endif
+
+// A `Matcher` can be awaited from a C++20 coroutine
+#if defined(__has_include)
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+#include <coroutine>
+#define REGEX_COROUTINES
+#endif
+#endif
 
 // #define DEBUG
 // #define CACHING
+// #define STATS
 
 static int current_state_id = 0;
 
@@ -36,6 +55,450 @@ private:
 
 DebugStream debug;
 
+// Counters describing how a regex was compiled and how it has been used.
+// They are only updated when `STATS` is defined, so without it the
+// matching loop does no extra work.
+struct RegexStats {
+    // The number of states in the compiled NFA
+    int states;
+    // The number of input bytes consumed by the matcher
+    long long bytes_scanned;
+    // Activity of the lazily built DFA (used by `match_batch`, and by
+    // `match` and `search` when `CACHING` is defined)
+    long long cache_hits, cache_misses, cache_flushes;
+    // The largest active state list seen while matching
+    int max_active;
+    // The time it took to compile the pattern, in microseconds
+    long long compile_us;
+
+    RegexStats() {
+        states = 0;
+        bytes_scanned = 0;
+        cache_hits = 0;
+        cache_misses = 0;
+        cache_flushes = 0;
+        max_active = 0;
+        compile_us = 0;
+    }
+
+    friend std::ostream &operator<<(std::ostream &os, const RegexStats &stats) {
+        os << "States: " << stats.states << std::endl;
+        os << "Bytes scanned: " << stats.bytes_scanned << std::endl;
+        os << "Cache hits: " << stats.cache_hits << std::endl;
+        os << "Cache misses: " << stats.cache_misses << std::endl;
+        os << "Cache flushes: " << stats.cache_flushes << std::endl;
+        os << "Max active states: " << stats.max_active << std::endl;
+        return os << "Compile time: " << stats.compile_us << "us";
+    }
+};
+
+// The error thrown when a pattern cannot be compiled
+class RegexError : public std::runtime_error {
+public:
+    RegexError(const std::string &message) : std::runtime_error(message) {}
+};
+
+// Caps on the resources a regex may use, for patterns or content that
+// come from untrusted sources. A limit of zero means unlimited.
+struct RegexLimits {
+    // The most states the compiled NFA may have
+    int max_states;
+    // The most memory the transition cache may hold before it is flushed
+    size_t max_cache_bytes;
+    // The most bytes of content a single match may scan. This is the same
+    // on every engine, and bytes that a search skips over count too.
+    long long max_steps;
+    // The longest a single match may run, in microseconds
+    long long max_time_us;
+
+    RegexLimits() {
+        max_states = 0;
+        max_cache_bytes = 0;
+        max_steps = 0;
+        max_time_us = 0;
+    }
+};
+
+// Enforces `RegexLimits::max_steps` and `max_time_us` on one match.
+// The clock is only read every `CLOCK_STRIDE` steps of work, since it is slow.
+class RegexBudget {
+public:
+    enum {
+        CLOCK_STRIDE = 1024
+    };
+
+    // Start the clock for a match that has already done `work`
+    RegexBudget(const RegexLimits &limits, long long work=0) {
+        this->max_steps = limits.max_steps;
+        this->max_time_us = limits.max_time_us;
+        this->next_clock_check = work + CLOCK_STRIDE;
+        if (this->max_time_us > 0) {
+            this->deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(this->max_time_us);
+        }
+    }
+
+    // May a match that has done `work` so far scan the byte at `position`?
+    bool allows(long long position, long long work) {
+        if (this->max_steps > 0 && position >= this->max_steps) {
+            return false;
+        }
+        if (this->max_time_us > 0 && work >= this->next_clock_check) {
+            this->next_clock_check = work + CLOCK_STRIDE;
+            return !expired();
+        }
+        return true;
+    }
+
+    // Has the time limit passed?
+    bool expired() const {
+        return this->max_time_us > 0 && std::chrono::steady_clock::now() > this->deadline;
+    }
+
+private:
+    long long max_steps, max_time_us, next_clock_check;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+// The outcome of a match that is subject to `RegexLimits`
+enum MatchResult {
+    NO_MATCH,
+    MATCH,
+    LIMIT_EXCEEDED
+};
+
+// Options that change how a pattern is compiled, combined with `|`
+enum RegexFlags {
+    // Letters match either case. This is done when the NFA is built, so
+    // content is never rewritten. Only ASCII letters are folded.
+    CASE_INSENSITIVE = 1
+};
+
+// The zero-width conditions a state can require of its position in the content
+enum Assertion {
+    NO_ASSERTION,
+    // `^`: at the beginning of the content
+    ASSERT_BEGIN,
+    // `$`: at the end of the content
+    ASSERT_END,
+    // `\b`: between a word byte and a non-word byte
+    ASSERT_WORD_BOUNDARY,
+    // `\B`: not at a word boundary
+    ASSERT_NOT_WORD_BOUNDARY
+};
+
+// Is this byte part of a word for `\b`? -1 stands for the edge of the content.
+bool is_word_byte(int c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+// Write a set of bytes like `[a-z\x80-\xBF]`
+// A byte as itself if it is printable ASCII, and as `\xHH` otherwise
+std::string describe_byte(int c) {
+    if (c > ' ' && c < 0x7F) {
+        return std::string(1, (char)c);
+    }
+    const char *digits = "0123456789ABCDEF";
+    std::string result = "\\x";
+    result += digits[c >> 4];
+    result += digits[c & 0xF];
+    return result;
+}
+
+std::string describe_bytes(const std::bitset<256> &bytes) {
+    std::stringstream ss;
+    ss << '[';
+    for (int lo = 0; lo < 256; lo++) {
+        if (!bytes[lo]) {
+            continue;
+        }
+        int hi = lo;
+        while (hi + 1 < 256 && bytes[hi + 1]) {
+            hi++;
+        }
+        int ends[] = {lo, hi};
+        for (int k = 0; k < (lo == hi? 1 : 2); k++) {
+            if (k == 1) {
+                ss << '-';
+            }
+            ss << describe_byte(ends[k]);
+        }
+        lo = hi;
+    }
+    ss << ']';
+    return ss.str();
+}
+
+// A range of codepoints, including both ends
+typedef std::pair<int, int> CodepointRange;
+
+// A run of byte ranges, one per byte of a UTF-8 encoded character
+typedef std::vector< std::pair<int, int> > ByteSequence;
+
+// The length of the UTF-8 sequence starting at `s[i]`, or 1 if it is not valid UTF-8
+int utf8_length(const std::string &s, int i) {
+    unsigned char lead = s[i];
+    int length = 1;
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        length = 2;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        length = 3;
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        length = 4;
+    }
+    for (int k = 1; k < length; k++) {
+        if (i + k >= s.size() || (s[i+k] & 0xC0) != 0x80) {
+            return 1;
+        }
+    }
+    return length;
+}
+
+// Decode the character starting at `s[i]` and move `i` past it.
+// Bytes that are not valid UTF-8 decode as themselves.
+int decode_utf8(const std::string &s, int &i) {
+    int length = utf8_length(s, i);
+    if (length == 1) {
+        return (unsigned char)s[i++];
+    }
+    int codepoint = (unsigned char)s[i] & (0xFF >> (length + 1));
+    for (int k = 1; k < length; k++) {
+        codepoint = (codepoint << 6) | (s[i+k] & 0x3F);
+    }
+    i += length;
+    return codepoint;
+}
+
+std::string encode_utf8(int codepoint) {
+    std::string result;
+    if (codepoint < 0x80) {
+        result += (char)codepoint;
+    } else if (codepoint < 0x800) {
+        result += (char)(0xC0 | (codepoint >> 6));
+        result += (char)(0x80 | (codepoint & 0x3F));
+    } else if (codepoint < 0x10000) {
+        result += (char)(0xE0 | (codepoint >> 12));
+        result += (char)(0x80 | ((codepoint >> 6) & 0x3F));
+        result += (char)(0x80 | (codepoint & 0x3F));
+    } else {
+        result += (char)(0xF0 | (codepoint >> 18));
+        result += (char)(0x80 | ((codepoint >> 12) & 0x3F));
+        result += (char)(0x80 | ((codepoint >> 6) & 0x3F));
+        result += (char)(0x80 | (codepoint & 0x3F));
+    }
+    return result;
+}
+
+// The length of the escape sequence starting with the `\` at `s[i]`
+int escape_length(const std::string &s, int i) {
+    if (i + 1 >= s.size() || !s[i+1]) {
+        throw RegexError("Trailing '\\' in regex");
+    }
+    if (s[i+1] != 'x') {
+        return 1 + utf8_length(s, i + 1);
+    }
+    if (i + 2 < s.size() && s[i+2] == '{') {
+        size_t end = s.find('}', i + 3);
+        if (end == std::string::npos) {
+            throw RegexError("Unterminated '\\x{' escape in regex");
+        }
+        return end - i + 1;
+    }
+    return 4;
+}
+
+// Read the character that the escape at `s[i]` stands for, and move `i` past it.
+// `\xHH` and `\x{HHHHHH}` are codepoints, anything else is the escaped character itself.
+int parse_escape(const std::string &s, int &i) {
+    int length = escape_length(s, i);
+    int codepoint = 0;
+    if (s[i+1] == 'x') {
+        std::string digits = s[i+2] == '{'? s.substr(i + 3, length - 4) : s.substr(i + 2, 2);
+        if (digits.empty() || digits.size() > 6 || (s[i+2] != '{' && digits.size() != 2)) {
+            throw RegexError("Invalid '\\x' escape in regex");
+        }
+        for (int k = 0; k < digits.size(); k++) {
+            char d = digits[k];
+            int value = d >= '0' && d <= '9'? d - '0' : d >= 'a' && d <= 'f'? d - 'a' + 10 : d >= 'A' && d <= 'F'? d - 'A' + 10 : -1;
+            if (value < 0) {
+                throw RegexError("Invalid '\\x' escape in regex");
+            }
+            codepoint = codepoint * 16 + value;
+        }
+        if (codepoint > 0x10FFFF || (codepoint >= 0xD800 && codepoint <= 0xDFFF)) {
+            throw RegexError("Invalid codepoint in regex");
+        }
+    } else {
+        int j = i + 1;
+        codepoint = decode_utf8(s, j);
+    }
+    i += length;
+    return codepoint;
+}
+
+// Add the other case of every ASCII letter in `ranges`
+void fold_case(std::vector<CodepointRange> &ranges) {
+    int count = ranges.size();
+    for (int k = 0; k < count; k++) {
+        int lo = std::max(ranges[k].first, (int)'a'), hi = std::min(ranges[k].second, (int)'z');
+        if (lo <= hi) {
+            ranges.push_back(CodepointRange(lo - 'a' + 'A', hi - 'a' + 'A'));
+        }
+        lo = std::max(ranges[k].first, (int)'A');
+        hi = std::min(ranges[k].second, (int)'Z');
+        if (lo <= hi) {
+            ranges.push_back(CodepointRange(lo - 'A' + 'a', hi - 'A' + 'a'));
+        }
+    }
+}
+
+// Parse a class like `[a-z_]` or `[^\x00-\x7F]` into sorted, disjoint codepoint ranges.
+// With `case_insensitive`, letters are folded before a `^` takes the complement.
+std::vector<CodepointRange> parse_class(const std::string &atom, bool case_insensitive=false) {
+    std::vector<CodepointRange> ranges;
+    int i = 1, end = atom.size() - 1;
+    bool negated = atom[i] == '^';
+    if (negated) {
+        i++;
+    }
+    while (i < end) {
+        int lo = atom[i] == '\\'? parse_escape(atom, i) : decode_utf8(atom, i);
+        int hi = lo;
+        if (atom[i] == '-' && i + 1 < end) {
+            i++;
+            hi = atom[i] == '\\'? parse_escape(atom, i) : decode_utf8(atom, i);
+            if (hi < lo) {
+                throw RegexError("Invalid range in class");
+            }
+        }
+        ranges.push_back(CodepointRange(lo, hi));
+    }
+    if (ranges.empty()) {
+        throw RegexError("Empty class in regex");
+    }
+    if (case_insensitive) {
+        fold_case(ranges);
+    }
+
+    std::sort(ranges.begin(), ranges.end());
+    std::vector<CodepointRange> merged;
+    for (int k = 0; k < ranges.size(); k++) {
+        if (!merged.empty() && ranges[k].first <= merged.back().second + 1) {
+            merged.back().second = std::max(merged.back().second, ranges[k].second);
+        } else {
+            merged.push_back(ranges[k]);
+        }
+    }
+    if (!negated) {
+        return merged;
+    }
+
+    std::vector<CodepointRange> complement;
+    int next = 0;
+    for (int k = 0; k < merged.size(); k++) {
+        if (merged[k].first > next) {
+            complement.push_back(CodepointRange(next, merged[k].first - 1));
+        }
+        next = merged[k].second + 1;
+    }
+    if (next <= 0x10FFFF) {
+        complement.push_back(CodepointRange(next, 0x10FFFF));
+    }
+    if (complement.empty()) {
+        throw RegexError("Empty class in regex");
+    }
+    return complement;
+}
+
+// Split a codepoint range into runs of byte ranges that match exactly its UTF-8 encodings.
+// For example U+0080-U+07FF is `[\xC2-\xDF][\x80-\xBF]`.
+std::vector<ByteSequence> utf8_sequences(int lo, int hi) {
+    std::vector<ByteSequence> result;
+    std::vector<CodepointRange> stack;
+    stack.push_back(CodepointRange(lo, hi));
+    while (!stack.empty()) {
+        int start = stack.back().first, end = stack.back().second;
+        stack.pop_back();
+
+        // Surrogates have no encoding, so leave them out.
+        // Ranges are pushed high half first so they come out in order.
+        if (start <= 0xDFFF && end >= 0xD800) {
+            if (end > 0xDFFF) {
+                stack.push_back(CodepointRange(0xE000, end));
+            }
+            if (start < 0xD800) {
+                stack.push_back(CodepointRange(start, 0xD7FF));
+            }
+            continue;
+        }
+
+        // Split ranges whose ends encode to a different number of bytes
+        bool split = false;
+        int widths[] = {0x7F, 0x7FF, 0xFFFF};
+        for (int k = 0; k < 3 && !split; k++) {
+            if (start <= widths[k] && end > widths[k]) {
+                stack.push_back(CodepointRange(widths[k] + 1, end));
+                stack.push_back(CodepointRange(start, widths[k]));
+                split = true;
+            }
+        }
+
+        // Split ranges until every trailing byte either covers all of
+        // `\x80-\xBF` or is shared by the whole range
+        for (int n = 1; n < 4 && !split; n++) {
+            int mask = (1 << (6 * n)) - 1;
+            if ((start & ~mask) == (end & ~mask)) {
+                continue;
+            }
+            if ((start & mask) != 0) {
+                stack.push_back(CodepointRange((start | mask) + 1, end));
+                stack.push_back(CodepointRange(start, start | mask));
+                split = true;
+            } else if ((end & mask) != mask) {
+                stack.push_back(CodepointRange(end & ~mask, end));
+                stack.push_back(CodepointRange(start, (end & ~mask) - 1));
+                split = true;
+            }
+        }
+        if (split) {
+            continue;
+        }
+
+        std::string first = encode_utf8(start), last = encode_utf8(end);
+        ByteSequence sequence;
+        for (int k = 0; k < first.size(); k++) {
+            sequence.push_back(std::make_pair((unsigned char)first[k], (unsigned char)last[k]));
+        }
+        result.push_back(sequence);
+    }
+    return result;
+}
+
+bool is_operator(char c) {
+    return c == '*' || c == '+' || c == '?' || c == '.' || c == '|' || c == '(' || c == ')';
+}
+
+// The length of the atom (something that matches on its own) at `pattern[i]`.
+// This is a single (possibly multibyte) character, an escape, or a class.
+int atom_length(const std::string &pattern, int i) {
+    if (pattern[i] == '\\') {
+        int j = i;
+        parse_escape(pattern, j);
+        return j - i;
+    }
+    if (pattern[i] == '[') {
+        int j = i + 1;
+        while (j < pattern.size() && pattern[j] && pattern[j] != ']') {
+            j += pattern[j] == '\\'? escape_length(pattern, j) : utf8_length(pattern, j);
+        }
+        if (j >= pattern.size() || !pattern[j]) {
+            throw RegexError("Unterminated class in regex");
+        }
+        parse_class(pattern.substr(i, j - i + 1));
+        return j - i + 1;
+    }
+    return utf8_length(pattern, i);
+}
+
 class StateList;
 
 // A state class that represents a state in the NFA
@@ -44,6 +507,9 @@ public:
     // Constructor for a state that has a character and two out states
     State(char c, State *out1, State *out2) {
         this->is_root = false;
+        this->is_match_state = false;
+        this->assertion = NO_ASSERTION;
+        this->is_class = false;
         this->c = c;
         this->out1 = out1;
         this->out1id = out1 != nullptr? out1->id() : -1;
@@ -55,6 +521,9 @@ public:
     // Constructor for a state that has a character and one out state
     State(char c, State *out1) {
         this->is_root = false;
+        this->is_match_state = false;
+        this->assertion = NO_ASSERTION;
+        this->is_class = false;
         this->c = c;
         this->out1 = out1;
         this->out1id = out1 != nullptr? out1->id() : -1;
@@ -67,6 +536,8 @@ public:
     State() {
         this->is_root = false;
         this->is_match_state = false;
+        this->assertion = NO_ASSERTION;
+        this->is_class = false;
         this->c = 0;
         this->out1 = nullptr;
         this->out1id = -1;
@@ -78,6 +549,38 @@ public:
     State(bool is_match_state) {
         this->is_root = false;
         this->is_match_state = is_match_state;
+        this->assertion = NO_ASSERTION;
+        this->is_class = false;
+        this->c = 0;
+        this->out1 = nullptr;
+        this->out1id = -1;
+        this->out2 = nullptr;
+        this->out2id = -1;
+        this->stateid = current_state_id++;
+    }
+
+    // Constructor for a state that matches any byte in a set
+    State(const std::bitset<256> &bytes, State *out1) {
+        this->is_root = false;
+        this->is_match_state = false;
+        this->assertion = NO_ASSERTION;
+        this->is_class = true;
+        this->bytes = bytes;
+        this->c = 0;
+        this->out1 = out1;
+        this->out1id = out1 != nullptr? out1->id() : -1;
+        this->out2 = nullptr;
+        this->out2id = -1;
+        this->stateid = current_state_id++;
+    }
+
+    // Constructor for a zero-width assertion, which passes through
+    // to its out states only where the assertion holds
+    State(Assertion assertion) {
+        this->is_root = false;
+        this->is_match_state = false;
+        this->assertion = assertion;
+        this->is_class = false;
         this->c = 0;
         this->out1 = nullptr;
         this->out1id = -1;
@@ -86,7 +589,9 @@ public:
         this->stateid = current_state_id++;
     }
 
-    void patch(State *state) {
+    // Add an out transition to `state`. Any state this has to create is
+    // added to `created`, so that it counts against `max_states`.
+    void patch(State *state, std::vector<State *> *created=nullptr) {
         debug << "Patching state " << this->stateid << " with state " << state->stateid << std::endl;
         if (this->out1 == nullptr) {
             this->out1 = state;
@@ -95,8 +600,16 @@ public:
             this->out2 = state;
             this->out2id = state->id();
         } else {
-            this->out1->patch(state);
-            this->out2->patch(state);
+            // Both outs are taken, so fan out through a new epsilon state.
+            // (Patching the out states instead would also connect whatever comes after them.)
+            State *fanout = new State();
+            if (created != nullptr) {
+                created->push_back(fanout);
+            }
+            fanout->patch(this->out2);
+            fanout->patch(state);
+            this->out2 = fanout;
+            this->out2id = fanout->id();
         }
     }
 
@@ -114,30 +627,77 @@ public:
         return this->stateid != rhs.stateid;
     }
 
-    bool accept() {
+    // Can this state reach the match state without consuming anything?
+    // `prev` and `next` are the bytes around the current position, or -1 at the edges.
+    bool accept(int prev=-1, int next=-1) {
         static std::set<State *> visited;
         if (this->is_match_state) {
             return true;
         }
-        if (!this->is_epsilon()) {
+        if (this->is_assertion()) {
+            if (!this->check(prev, next)) {
+                return false;
+            }
+        } else if (!this->is_epsilon()) {
             return false;
         }
         if (visited.find(this) != visited.end()) {
             return false;
         }
         visited.insert(this);
-        bool can_transition_to_match = (this->out1 != nullptr && this->out1->accept()) || (this->out2 != nullptr && this->out2->accept());
-        bool result = this->is_epsilon() && can_transition_to_match;
+        bool result = (this->out1 != nullptr && this->out1->accept(prev, next)) || (this->out2 != nullptr && this->out2->accept(prev, next));
         visited.erase(this);
         return result;
     }
 
     bool is_match(char c) const {
+        if (this->is_class) {
+            return this->bytes[(unsigned char)c];
+        }
         return this->c == c;
     }
 
     bool is_epsilon() const {
-        return this->c == 0;
+        return this->c == 0 && this->assertion == NO_ASSERTION && !this->is_class;
+    }
+
+    // The bytes this state consumes, empty for states that consume nothing
+    std::bitset<256> getbytes() const {
+        std::bitset<256> result;
+        if (this->is_class) {
+            result = this->bytes;
+        } else if (this->c != 0) {
+            result[(unsigned char)this->c] = true;
+        }
+        return result;
+    }
+
+    Assertion getassertion() const {
+        return this->assertion;
+    }
+
+    bool is_assertion() const {
+        return this->assertion != NO_ASSERTION;
+    }
+
+    bool is_accepting() const {
+        return this->is_match_state;
+    }
+
+    // Does this state's assertion hold between the bytes `prev` and `next`?
+    bool check(int prev, int next) const {
+        switch (this->assertion) {
+            case ASSERT_BEGIN:
+                return prev == -1;
+            case ASSERT_END:
+                return next == -1;
+            case ASSERT_WORD_BOUNDARY:
+                return is_word_byte(prev) != is_word_byte(next);
+            case ASSERT_NOT_WORD_BOUNDARY:
+                return is_word_byte(prev) == is_word_byte(next);
+            default:
+                return true;
+        }
     }
 
     State *getout1() {
@@ -152,6 +712,34 @@ public:
         return this->stateid;
     }
 
+    // Forget the out states, so that deleting this state only deletes itself
+    void unlink() {
+        this->out1 = nullptr;
+        this->out1id = -1;
+        this->out2 = nullptr;
+        this->out2id = -1;
+    }
+
+    // A short human readable description of what this state does
+    std::string label() const {
+        if (this->is_match_state) {
+            return "Match";
+        } else if (this->assertion == ASSERT_BEGIN) {
+            return "^";
+        } else if (this->assertion == ASSERT_END) {
+            return "$";
+        } else if (this->assertion == ASSERT_WORD_BOUNDARY) {
+            return "\\b";
+        } else if (this->assertion == ASSERT_NOT_WORD_BOUNDARY) {
+            return "\\B";
+        } else if (this->is_epsilon()) {
+            return "Epsilon";
+        } else if (this->is_class) {
+            return describe_bytes(this->bytes);
+        }
+        return describe_byte((unsigned char)this->c);
+    }
+
     friend std::ostream &operator<<(std::ostream &os, const State &state) {
         static int indent = 0;
         for (int i = 0; i < indent; i++) {
@@ -165,7 +753,7 @@ public:
         } else if (state.is_epsilon()) {
             os << "State (" << state.stateid << ") => Epsilon" << std::endl;
         } else {
-            os  << "State (" << state.stateid << ") => " << (char)state.c << std::endl;
+            os  << "State (" << state.stateid << ") => " << state.label() << std::endl;
         }
         if (std::find(visited.begin(), visited.end(), state.stateid) != visited.end()) {
             return os;
@@ -218,11 +806,6 @@ public:
         }
     }
 
-private:
-    void set_root(bool is_root) {
-        this->is_root = is_root;
-    }
-
     std::unordered_set<State*> collect_states() {
         std::unordered_set<State*> visited;
         std::stack<State*> stack;
@@ -233,7 +816,7 @@ private:
         while (!stack.empty()) {
             State *state = stack.top();
             stack.pop();
-            if (std::find(visited.begin(), visited.end(), state) != visited.end()) {
+            if (visited.find(state) != visited.end()) {
                 continue;
             }
             visited.insert(state);
@@ -249,7 +832,15 @@ private:
         return visited;
     }
 
+private:
+    void set_root(bool is_root) {
+        this->is_root = is_root;
+    }
+
     bool is_match_state;
+    Assertion assertion;
+    bool is_class;
+    std::bitset<256> bytes;
     int c;
     State *out1;
     State *out2;
@@ -288,10 +879,10 @@ public:
         return this->states.find(state) != this->states.end();
     }
 
-    void patch(State *state) {
+    void patch(State *state, std::vector<State *> *created=nullptr) {
         debug << "Patching state " << state->id() << " with " << this->states.size() << " states" << std::endl;
         for (std::set<State *>::iterator it = this->states.begin(); it != this->states.end(); it++) {
-            (*it)->patch(state);
+            (*it)->patch(state, created);
         }
     }
 
@@ -324,24 +915,162 @@ public:
     StateList *out;
 };
 
-State *post2nfa(std::string postfix) {
+// Free the state lists owned by a set of fragments.
+// The same list may be shared by several fragments, so each is deleted once.
+void free_fragments(std::vector<Fragment> &frags) {
+    std::set<uintptr_t> visited;
+    for (int i = 0; i < frags.size(); i++) {
+        if (visited.find((uintptr_t)frags[i].out) == visited.end()) {
+            visited.insert((uintptr_t)frags[i].out);
+            delete frags[i].out;
+        }
+    }
+}
+
+// Free everything built so far by a failed `post2nfa`, then report the error
+void abandon_nfa(std::vector<State *> &created, std::vector<Fragment> &frags, std::string message) {
+    free_fragments(frags);
+    // Patching may have added states of its own, so free everything reachable
+    std::unordered_set<State *> states;
+    std::stack<State *> stack;
+    for (int i = 0; i < created.size(); i++) {
+        stack.push(created[i]);
+    }
+    while (!stack.empty()) {
+        State *state = stack.top();
+        stack.pop();
+        if (state == nullptr || states.find(state) != states.end()) {
+            continue;
+        }
+        states.insert(state);
+        stack.push(state->getout1());
+        stack.push(state->getout2());
+    }
+    for (std::unordered_set<State *>::iterator it = states.begin(); it != states.end(); it++) {
+        (*it)->unlink();
+        delete *it;
+    }
+    throw RegexError(message);
+}
+
+// Build a fragment that matches the bytes of `literal` one after another.
+// With `case_insensitive`, each letter becomes a two byte class.
+Fragment literal2nfa(const std::string &literal, std::vector<State *> &created, bool case_insensitive=false) {
+    if (literal.find('\0') != std::string::npos) {
+        throw RegexError("NUL bytes are not supported in regex");
+    }
+    State *first = nullptr, *last = nullptr;
+    for (int k = 0; k < literal.size(); k++) {
+        char c = literal[k];
+        State *state;
+        if (case_insensitive && ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))) {
+            std::bitset<256> bytes;
+            bytes[c | 0x20] = true;
+            bytes[c & ~0x20] = true;
+            state = new State(bytes, nullptr);
+        } else {
+            state = new State(c, nullptr);
+        }
+        created.push_back(state);
+        if (last == nullptr) {
+            first = state;
+        } else {
+            last->patch(state);
+        }
+        last = state;
+    }
+    return Fragment(first, new StateList(last));
+}
+
+// Build a fragment that matches the UTF-8 encoding of any codepoint in `ranges`.
+// Each encoding is a run of byte range states, and runs that end the same
+// way share their states, so `[\x{800}-\x{FFFF}]` needs only a handful.
+Fragment class2nfa(const std::vector<CodepointRange> &ranges, std::vector<State *> &created) {
+    std::map< std::pair< std::pair<int, int>, State * >, State * > shared;
+    std::vector<State *> firsts;
+    StateList *out = new StateList();
+
+    for (int r = 0; r < ranges.size(); r++) {
+        std::vector<ByteSequence> sequences = utf8_sequences(ranges[r].first, ranges[r].second);
+        for (int k = 0; k < sequences.size(); k++) {
+            // Build the run back to front, so each state can be shared with
+            // every other run that goes on to the same states
+            State *next = nullptr;
+            for (int b = sequences[k].size() - 1; b >= 0; b--) {
+                std::pair< std::pair<int, int>, State * > key(sequences[k][b], next);
+                if (shared.find(key) == shared.end()) {
+                    std::bitset<256> bytes;
+                    for (int byte = key.first.first; byte <= key.first.second; byte++) {
+                        bytes[byte] = true;
+                    }
+                    State *state = new State(bytes, next);
+                    created.push_back(state);
+                    shared[key] = state;
+                    if (next == nullptr) {
+                        out->addstate(state);
+                    }
+                }
+                next = shared[key];
+            }
+            if (std::find(firsts.begin(), firsts.end(), next) == firsts.end()) {
+                firsts.push_back(next);
+            }
+        }
+    }
+
+    // Choose between the first bytes with a chain of splits
+    State *start = firsts.back();
+    for (int k = (int)firsts.size() - 2; k >= 0; k--) {
+        State *split = new State();
+        created.push_back(split);
+        split->patch(firsts[k]);
+        split->patch(start);
+        start = split;
+    }
+    return Fragment(start, out);
+}
+
+// Build the fragment for the atom at `postfix[i]`, and move `i` to its last byte
+Fragment atom2nfa(const std::string &postfix, int &i, std::vector<State *> &created, bool case_insensitive=false) {
+    int length = atom_length(postfix, i);
+    std::string atom = postfix.substr(i, length);
+    i += length - 1;
+
+    if (atom[0] == '[') {
+        return class2nfa(parse_class(atom, case_insensitive), created);
+    } else if (atom == "\\b" || atom == "\\B") {
+        State *state = new State(atom == "\\b"? ASSERT_WORD_BOUNDARY : ASSERT_NOT_WORD_BOUNDARY);
+        created.push_back(state);
+        return Fragment(state, new StateList(state));
+    } else if (atom[0] == '\\') {
+        int j = 0;
+        return literal2nfa(encode_utf8(parse_escape(atom, j)), created, case_insensitive);
+    }
+    return literal2nfa(atom, created, case_insensitive);
+}
+
+State *post2nfa(std::string postfix, int max_states=0, int flags=0) {
+    std::vector<State *> created;
     std::vector<Fragment> allfrags;
     std::vector<Fragment> stack;
     Fragment e1, e2, e;
     State *state;
 
     for (int i = 0; i < postfix.size() && postfix[i]; i++) {
+        if (max_states > 0 && created.size() > max_states) {
+            abandon_nfa(created, allfrags, "Regex is too large");
+        }
         debug << postfix[i] << std::endl;
         switch (postfix[i]) {
             case '.':
                 if (stack.size() < 2) {
-                    continue;
+                    abandon_nfa(created, allfrags, "Missing operand in regex");
                 }
                 e2 = stack.back();
                 stack.pop_back();
                 e1 = stack.back();
                 stack.pop_back();
-                e1.out->patch(e2.start);
+                e1.out->patch(e2.start, &created);
                 e.start = e1.start;
                 e.out = e2.out;
                 stack.push_back(e);
@@ -349,7 +1078,7 @@ State *post2nfa(std::string postfix) {
                 break;
             case '|':
                 if (stack.size() < 2) {
-                    continue;
+                    abandon_nfa(created, allfrags, "Missing operand in regex");
                 }
 
                 e2 = stack.back();
@@ -357,6 +1086,7 @@ State *post2nfa(std::string postfix) {
                 e1 = stack.back();
                 stack.pop_back();
                 state = new State();
+                created.push_back(state);
                 state->patch(e1.start);
                 state->patch(e2.start);
                 e.start = state;
@@ -367,13 +1097,14 @@ State *post2nfa(std::string postfix) {
                 break;
             case '*':
                 if (stack.empty()) {
-                    continue;
+                    abandon_nfa(created, allfrags, "Missing operand in regex");
                 }
 
                 e1 = stack.back();
                 stack.pop_back();
                 state = new State();
-                e1.out->patch(state);
+                created.push_back(state);
+                e1.out->patch(state, &created);
                 e.start = state;
                 state->patch(e1.start);
                 e.out = new StateList(state);
@@ -382,27 +1113,29 @@ State *post2nfa(std::string postfix) {
                 break;
             case '+':
                 if (stack.empty()) {
-                    continue;
+                    abandon_nfa(created, allfrags, "Missing operand in regex");
                 }
 
                 e1 = stack.back();
                 stack.pop_back();
                 state = new State();
+                created.push_back(state);
                 state->patch(e1.start);
                 e.start = e1.start;
                 e.out = e1.out;
-                e.out->patch(state);
+                e.out->patch(state, &created);
                 stack.push_back(e);
                 allfrags.push_back(e);
                 break;
             case '?':
                 if (stack.empty()) {
-                    continue;
+                    abandon_nfa(created, allfrags, "Missing operand in regex");
                 }
                 
                 e1 = stack.back();
                 stack.pop_back();
                 state = new State();
+                created.push_back(state);
                 state->patch(e1.start);
                 e.start = state;
                 e.out = new StateList(state);
@@ -410,55 +1143,51 @@ State *post2nfa(std::string postfix) {
                 stack.push_back(e);
                 allfrags.push_back(e);
                 break;
-            default:
-                state = new State(postfix[i], nullptr);
+            case '^':
+                state = new State(ASSERT_BEGIN);
+                created.push_back(state);
+                e.start = state;
+                e.out = new StateList(state);
+                stack.push_back(e);
+                allfrags.push_back(e);
+                break;
+            case '$':
+                state = new State(ASSERT_END);
+                created.push_back(state);
                 e.start = state;
                 e.out = new StateList(state);
                 stack.push_back(e);
                 allfrags.push_back(e);
                 break;
+            default:
+                try {
+                    e = atom2nfa(postfix, i, created, (flags & CASE_INSENSITIVE) != 0);
+                } catch (const RegexError &error) {
+                    abandon_nfa(created, allfrags, error.what());
+                }
+                stack.push_back(e);
+                allfrags.push_back(e);
+                break;
         }
     }
 
-    if (stack.empty()) {
-        std::cerr << "Invalid regex" << std::endl;
-        exit(1);
+    if (stack.size() != 1) {
+        abandon_nfa(created, allfrags, "Invalid regex");
     }
-
     e = stack.back();
     stack.pop_back();
-    e.out->patch(new State(true));
-
-    std::set<uintptr_t> visited;
-    for (int i = 0; i < allfrags.size(); i++) {
-        // delete allfrags[i].out;
-        if (visited.find((uintptr_t)allfrags[i].out) == visited.end()) {
-            visited.insert((uintptr_t)allfrags[i].out);
-            delete allfrags[i].out;
-        }
-    }
-
-    if (visited.find((uintptr_t)e.out) == visited.end()) {
-        visited.insert((uintptr_t)e.out);
-        delete e.out;
-    }
-    if (visited.find((uintptr_t)e1.out) == visited.end()) {
-        visited.insert((uintptr_t)e1.out);
-        delete e1.out;
-    }
-    if (visited.find((uintptr_t)e2.out) == visited.end()) {
-        visited.insert((uintptr_t)e2.out);
-        delete e2.out;
+    state = new State(true);
+    created.push_back(state);
+    e.out->patch(state, &created);
+    if (max_states > 0 && created.size() > max_states) {
+        abandon_nfa(created, allfrags, "Regex is too large");
     }
+    free_fragments(allfrags);
 
     return e.start;
 }
 
-bool is_operator(char c) {
-    return c == '*' || c == '+' || c == '?' || c == '.' || c == '|' || c == '(' || c == ')';
-}
-
-std::string infix2postfix(std::string postfix) {
+std::string infix2postfix(std::string infix) {
     std::string output;
     std::stack<char> operator_stack;
     std::map<char, int> precedence;
@@ -468,59 +1197,77 @@ std::string infix2postfix(std::string postfix) {
     precedence['|'] = 1;
     precedence['.'] = 2;
 
-    // First, go through and insert a '.' between all the non-operator characters
-    for (int i = 0; i < postfix.size() && postfix[i]; i++) {
-        if (!is_operator(postfix[i]) && i > 0 && !is_operator(postfix[i-1])) {
-            postfix.insert(i, ".");
+    // First, split the pattern into operators and atoms, and insert a '.'
+    // wherever two things are implicitly concatenated:
+    // ab => a.b, a(b|c) => a.(b|c), (a)*b => (a)*.b, \*b => \*.b
+    std::vector<std::string> tokens;
+    for (int i = 0; i < infix.size() && infix[i];) {
+        int length = is_operator(infix[i])? 1 : atom_length(infix, i);
+        std::string token = infix.substr(i, length);
+
+        if (!tokens.empty()) {
+            const std::string &last = tokens.back();
+            bool ends_expression = !is_operator(last[0]) || last == ")" || last == "*" || last == "+" || last == "?";
+            bool starts_expression = !is_operator(token[0]) || token == "(";
+            if (ends_expression && starts_expression) {
+                tokens.push_back(".");
+            }
         }
+        tokens.push_back(token);
+        i += length;
     }
-    debug << "Infix: " << postfix << std::endl;
 
-    // Now go through and handle parentheses
-    // a(b|c) => a.b|c
-    // (ab) => a.b
-    for (int i = 0; i < postfix.size() && postfix[i]; i++) {
-        if (postfix[i] == '(' && i > 0 && (!is_operator(postfix[i-1]) || postfix[i-1] == ')')) {
-            postfix.insert(i, ".");
-            i++;
-        }
-        
-        
-        if (i< postfix.size()-1 && postfix[i] == '*' && !is_operator(postfix[i+1])) {
-            postfix.insert(i+1, ".");
-            i++;
-        } else if (i< postfix.size()-1 && postfix[i] == '+' && !is_operator(postfix[i+1])) {
-            postfix.insert(i+1, ".");
-            i++;
-        } else if (i< postfix.size()-1 && postfix[i] == '?' && !is_operator(postfix[i+1])) {
-            postfix.insert(i+1, ".");
-            i++;
+    for (int i = 0; i < tokens.size(); i++) {
+        debug << tokens[i];
+    }
+    debug << std::endl;
+
+    // Every operator needs its operands: `*a`, `a|`, `(a|)` and `()` are errors
+    bool operand = false;
+    for (int i = 0; i < tokens.size(); i++) {
+        char c = tokens[i][0];
+        if (!is_operator(c)) {
+            operand = true;
+        } else if (c == '(') {
+            operand = false;
+        } else if (!operand) {
+            throw RegexError(std::string("Missing operand ") + (c == ')'? "before" : "for") + " '" + c + "' in regex");
+        } else if (c == '|' || c == '.') {
+            operand = false;
         }
     }
+    if (!operand) {
+        throw RegexError("Missing operand at the end of regex");
+    }
 
-    debug << "Infix: " << postfix << std::endl;
-
-    for (int i = 0; i < postfix.size() && postfix[i]; i++) {
-        if (postfix[i] == '(') {
-            operator_stack.push(postfix[i]);
-        } else if (postfix[i] == ')') {
+    for (int i = 0; i < tokens.size(); i++) {
+        char c = tokens[i][0];
+        if (!is_operator(c)) {
+            output += tokens[i];
+        } else if (c == '(') {
+            operator_stack.push(c);
+        } else if (c == ')') {
             while (!operator_stack.empty() && operator_stack.top() != '(') {
                 output += operator_stack.top();
                 operator_stack.pop();
             }
+            if (operator_stack.empty()) {
+                throw RegexError("Unmatched ')' in regex");
+            }
             operator_stack.pop();
-        } else if (precedence.find(postfix[i]) != precedence.end()) {
-            while (!operator_stack.empty() && precedence[operator_stack.top()] >= precedence[postfix[i]]) {
+        } else {
+            while (!operator_stack.empty() && precedence[operator_stack.top()] >= precedence[c]) {
                 output += operator_stack.top();
                 operator_stack.pop();
             }
-            operator_stack.push(postfix[i]);
-        } else {
-            output += postfix[i];
+            operator_stack.push(c);
         }
     }
 
     while (!operator_stack.empty()) {
+        if (operator_stack.top() == '(') {
+            throw RegexError("Unmatched '(' in regex");
+        }
         output += operator_stack.top();
         operator_stack.pop();
     }
@@ -530,160 +1277,1463 @@ std::string infix2postfix(std::string postfix) {
     return output;
 }
 
-#ifdef CACHING
-struct Hit {
-    std::map< std::vector<State *>, std::vector<State*> > stored;
-    std::vector<State *> clist, nlist;
-    int hits, misses;
-    bool ignore;
-
-    Hit() {
-        hits = 1;
-        misses = 0;
-        ignore = false;
-    }
-
-    Hit(std::vector<State *> clist, std::vector<State *> nlist) {
-        update(clist, nlist);
-        hits = 1;
-        misses = 0;
-        ignore = false;
-    }
-    
-    bool try_hit(std::vector<State*> &clist) {
-        bool hit = this->clist == clist;
-        if (hit) {
-            clist = this->nlist;
-            hits++;
+// Write the NFA reachable from `start` as a Graphviz digraph
+void nfa2dot(State *start, std::ostream &os) {
+    std::unordered_set<State *> states = start->collect_states();
+    std::map<int, State *> by_id;
+    for (std::unordered_set<State *>::iterator it = states.begin(); it != states.end(); it++) {
+        by_id[(*it)->id()] = *it;
+    }
+
+    os << "digraph nfa {" << std::endl;
+    os << "    rankdir=LR;" << std::endl;
+    os << "    start [shape=point];" << std::endl;
+    os << "    start -> s" << start->id() << ";" << std::endl;
+    for (std::map<int, State *>::iterator it = by_id.begin(); it != by_id.end(); it++) {
+        State *state = it->second;
+        std::string label = state->label();
+        std::string escaped;
+        for (int i = 0; i < label.size(); i++) {
+            if (label[i] == '"' || label[i] == '\\') {
+                escaped += '\\';
+            }
+            escaped += label[i];
+        }
+
+        os << "    s" << state->id() << " [label=\"" << escaped << "\"";
+        if (state->is_accepting()) {
+            os << ", shape=doublecircle";
+        } else if (state->is_assertion()) {
+            os << ", shape=box";
+        } else if (state->is_epsilon()) {
+            os << ", shape=circle, style=dashed";
         } else {
-            if (stored.find(clist) != stored.end()) {
-                clist = stored[clist];
-                hits++;
-                return true;
+            os << ", shape=circle";
+        }
+        os << "];" << std::endl;
+
+        if (state->getout1() != nullptr) {
+            os << "    s" << state->id() << " -> s" << state->getout1()->id() << ";" << std::endl;
+        }
+        if (state->getout2() != nullptr && state->getout2() != state->getout1()) {
+            os << "    s" << state->id() << " -> s" << state->getout2()->id() << ";" << std::endl;
+        }
+    }
+    os << "}" << std::endl;
+}
+
+// How much of the content a pattern has to match
+enum MatchMode {
+    // The whole content
+    FULL_MATCH,
+    // Any part of the content
+    SEARCH,
+    // Any part of the content that starts at the beginning, for patterns
+    // that can only match there (see `is_anchored`)
+    ANCHORED_SEARCH
+};
+
+// Can the pattern only match at the beginning of the content?
+// This is true when every path from `start` to something that consumes
+// a byte, or to the match state, passes through a `^`.
+bool is_anchored(State *start) {
+    std::set<State *> visited;
+    std::stack<State *> stack;
+    stack.push(start);
+    while (!stack.empty()) {
+        State *state = stack.top();
+        stack.pop();
+        if (visited.find(state) != visited.end() || state->getassertion() == ASSERT_BEGIN) {
+            // `^` never holds after the first byte, so nothing past it counts
+            continue;
+        }
+        visited.insert(state);
+        if (!state->is_epsilon() && !state->is_assertion()) {
+            return false;
+        }
+        if (state->is_accepting()) {
+            return false;
+        }
+        if (state->getout1() != nullptr) {
+            stack.push(state->getout1());
+        }
+        if (state->getout2() != nullptr) {
+            stack.push(state->getout2());
+        }
+    }
+    return true;
+}
+
+// The bytes that a match can start with. While no attempt is in progress,
+// `search` uses this to skip over content where no match can begin.
+struct Prefilter {
+    // Off for patterns that can match without consuming anything
+    bool enabled;
+    std::bitset<256> bytes;
+    // When at most two bytes can start a match, these are they
+    int count;
+    char first, second;
+
+    Prefilter() {
+        enabled = false;
+        count = 0;
+        first = 0;
+        second = 0;
+    }
+
+    Prefilter(State *start) {
+        std::set<State *> visited;
+        std::stack<State *> stack;
+        stack.push(start);
+        enabled = true;
+        while (!stack.empty()) {
+            State *state = stack.top();
+            stack.pop();
+            if (visited.find(state) != visited.end()) {
+                continue;
+            }
+            visited.insert(state);
+            if (state->is_accepting()) {
+                enabled = false;
+            } else if (state->is_epsilon() || state->is_assertion()) {
+                if (state->getout1() != nullptr) {
+                    stack.push(state->getout1());
+                }
+                if (state->getout2() != nullptr) {
+                    stack.push(state->getout2());
+                }
+            } else {
+                bytes |= state->getbytes();
+            }
+        }
+
+        count = bytes.count();
+        enabled = enabled && count < 256;
+        first = 0;
+        second = 0;
+        for (int c = 255; c >= 0; c--) {
+            if (bytes[c]) {
+                second = first;
+                first = (char)c;
             }
-            misses++;
         }
-        return hit;
+        if (count == 1) {
+            second = first;
+        }
     }
 
-    void update(std::vector<State*> clist, std::vector<State*> nlist) {
-        this->clist = clist;
-        this->nlist = nlist;
-        // if (stored.size() > 1000) {
-        //     stored.erase(stored.begin());
-        // }
-        stored[clist] = nlist;
+    // The first position from `i` where a match could start, or where the content ends
+    int find(const std::string &s, int i) const {
+        int n = s.size();
+        if (count <= 2) {
+            #if defined(__SSE2__) && defined(__GNUC__)
+            // Compare 16 bytes at a time against both bytes (and the NUL that ends the content)
+            __m128i a = _mm_set1_epi8(first), b = _mm_set1_epi8(second), zero = _mm_setzero_si128();
+            for (; i + 16 <= n; i += 16) {
+                __m128i chunk = _mm_loadu_si128((const __m128i *)(s.data() + i));
+                __m128i found = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, a), _mm_cmpeq_epi8(chunk, b)), _mm_cmpeq_epi8(chunk, zero));
+                int mask = _mm_movemask_epi8(found);
+                if (mask != 0) {
+                    return i + __builtin_ctz(mask);
+                }
+            }
+            #endif
+            for (; i < n && s[i] && s[i] != first && s[i] != second; i++) {}
+            return i;
+        }
+        for (; i < n && s[i] && !bytes[(unsigned char)s[i]]; i++) {}
+        return i;
     }
+};
 
-    bool is_hit(const std::vector<State*> &clist) const {
-        return this->clist == clist || stored.find(clist) != stored.end();
+// The states a simulation of the NFA is in between two bytes of content.
+// `try_match` steps one of these over a whole string at once, while a
+// `Matcher` keeps one between chunks of content that arrive separately.
+class ActiveStates {
+public:
+    ActiveStates(State *start=nullptr, MatchMode mode=FULL_MATCH) {
+        this->start = start;
+        this->mode = mode;
+        this->result = NO_MATCH;
+        this->finished = false;
+        if (start != nullptr && mode != SEARCH) {
+            // Searches start a new attempt at every position instead
+            this->clist.push_back(start);
+        }
+    }
+
+    // Is no attempt in progress?
+    bool empty() const {
+        return this->clist.empty();
     }
 
-    bool should_update() const {
-        return ignore || hits >= misses - 100;
+    // Has the outcome been decided before the end of the content?
+    // Searches finish when they find a match, and the other modes finish
+    // when no state is left, since nothing after that can match.
+    bool done() const {
+        return this->finished;
     }
+
+    // The outcome, once `done` is true
+    MatchResult verdict() const {
+        return this->result;
+    }
+
+    // Consume `c`, which comes after the byte `prev` (-1 at the start).
+    // Returns the number of states visited, as a measure of the work done.
+    int step(int prev, unsigned char c) {
+        if (this->mode == SEARCH) {
+            this->clist.push_back(this->start);
+        }
+
+        std::set<State *> visited;
+        for (int j = 0; j < this->clist.size(); j++) {
+            State *state = this->clist[j];
+
+            if (visited.find(state) != visited.end()) {
+                continue;
+            }
+
+            if (this->mode != FULL_MATCH && state->is_accepting()) {
+                // Searches can stop as soon as anything matches
+                this->result = MATCH;
+                this->finished = true;
+                break;
+            }
+
+            if (state->is_match(c)) {
+                if (state->getout1() != nullptr) {
+                    this->nlist.push_back(state->getout1());
+                }
+                if (state->getout2() != nullptr) {
+                    this->nlist.push_back(state->getout2());
+                }
+            } else if (state->is_epsilon() || (state->is_assertion() && state->check(prev, c))) {
+                visited.insert(state);
+
+                if (state->getout1() != nullptr) {
+                    this->clist.push_back(state->getout1());
+                }
+                if (state->getout2() != nullptr) {
+                    this->clist.push_back(state->getout2());
+                }
+            }
+        }
+        int work = this->clist.size();
+
+        if (!this->finished && this->nlist.empty() && this->mode != SEARCH) {
+            this->finished = true;
+        }
+        this->clist.swap(this->nlist);
+        this->nlist.clear();
+        return work;
+    }
+
+    // Does the content match if it ends here, after the byte `prev`?
+    bool accepts(int prev) const {
+        if (this->finished) {
+            return this->result == MATCH;
+        }
+        if (this->mode == SEARCH && this->start->accept(prev, -1)) {
+            // An empty match at the very end
+            return true;
+        }
+        for (int j = 0; j < this->clist.size(); j++) {
+            if (this->clist[j]->accept(prev, -1)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    State *start;
+    MatchMode mode;
+    std::vector<State *> clist, nlist;
+    MatchResult result;
+    bool finished;
 };
-#endif
 
-bool match(State *start, std::string s) {
-    std::vector<State*> clist, nlist, last_clist;
-    clist.push_back(start);
+MatchResult try_match(State *start, const std::string &s, const RegexLimits &limits, RegexStats *stats=nullptr, MatchMode mode=FULL_MATCH, const Prefilter *prefilter=nullptr) {
+    ActiveStates active(start, mode);
 
+    #ifdef STATS
+    // Keep the counters in locals and publish them once at the end
+    long long scanned = 0;
+    int max_active = 1;
+    #endif
+    MatchResult result = NO_MATCH;
+    bool finished = false;
+
+    // States visited so far, used to decide when to look at the clock
+    long long steps = 0;
+    RegexBudget budget(limits);
+
+    int i = 0;
+    for (; i < s.size() && s[i]; i++) {
+        if (mode == SEARCH && active.empty() && prefilter != nullptr && prefilter->enabled) {
+            // Nothing is in progress, so skip to where a match could start
+            i = prefilter->find(s, i);
+            if (i >= s.size() || !s[i]) {
+                // The skip looked at every byte up to the end
+                if (!budget.allows(i - 1, steps)) {
+                    result = LIMIT_EXCEEDED;
+                    finished = true;
+                }
+                break;
+            }
+        }
+
+        // Stop if there is still content left but no budget to scan it
+        if (!budget.allows(i, steps)) {
+            result = LIMIT_EXCEEDED;
+            finished = true;
+            break;
+        }
 
-    #ifdef CACHING
-    std::map< char, Hit > states;
+        int work = active.step(i > 0? (unsigned char)s[i-1] : -1, s[i]);
+        steps += work;
+        #ifdef STATS
+        scanned++;
+        if (work > max_active) {
+            max_active = work;
+        }
+        #endif
+        if (active.done()) {
+            result = active.verdict();
+            finished = true;
+            break;
+        }
+    }
+
+    #ifdef STATS
+    if (stats != nullptr) {
+        stats->bytes_scanned += scanned;
+        if (max_active > stats->max_active) {
+            stats->max_active = max_active;
+        }
+    }
     #endif
 
-    for (int i = 0; i < s.size() && s[i]; i++) {
-        #ifdef CACHING
-        // if (last_clist == clist && i>0 && s[i] == s[i-1]) {
-        //     continue;
-        // }
-        if (states.find(s[i]) != states.end()) {
-            if (states[s[i]].try_hit(clist)) {
+    if (finished) {
+        return result;
+    }
+    return active.accepts(i > 0? (unsigned char)s[i-1] : -1)? MATCH : NO_MATCH;
+}
+
+bool match(State *start, const std::string &s, RegexStats *stats=nullptr) {
+    return try_match(start, s, RegexLimits(), stats) == MATCH;
+}
+
+// A Glushkov automaton run bit-parallel. The automaton has one state per
+// position (byte range) in the pattern plus an initial state, and all of
+// the states that are active fit in one 64-bit word. Each byte advances
+// every active state at once: OR together the follow sets of the active
+// states with a few table lookups, then AND with the states that byte
+// can enter. There is nothing to determinize or cache.
+class Glushkov {
+public:
+    enum {
+        // The most positions a pattern may have, since bit 0 is the initial state
+        MAX_POSITIONS = 63
+    };
+
+    // Build the tables from the follow set and byte set of each state
+    Glushkov(const std::vector<uint64_t> &follow, const std::vector< std::bitset<256> > &bytes, uint64_t final) {
+        this->final = final;
+        this->chunks = (follow.size() + 7) / 8;
+        this->masks.assign(256, 0);
+        for (int p = 0; p < bytes.size(); p++) {
+            for (int c = 0; c < 256; c++) {
+                if (bytes[p][c]) {
+                    this->masks[c] |= (uint64_t)1 << p;
+                }
+            }
+        }
+
+        // The follow set of a whole set of states is looked up one byte
+        // of the set at a time: `follow_tables[k * 256 + v]` is the union
+        // of the follow sets of states `8k + j` for each bit `j` in `v`
+        this->follow_tables.assign(this->chunks * 256, 0);
+        for (int k = 0; k < this->chunks; k++) {
+            for (int v = 0; v < 256; v++) {
+                for (int j = 0; j < 8 && 8 * k + j < follow.size(); j++) {
+                    if ((v >> j) & 1) {
+                        this->follow_tables[k * 256 + v] |= follow[8 * k + j];
+                    }
+                }
+            }
+        }
+    }
+
+    // Advance every active state over one byte
+    uint64_t step(uint64_t active, unsigned char c) const {
+        uint64_t next = 0;
+        for (int k = 0; k < this->chunks; k++) {
+            next |= this->follow_tables[k * 256 + ((active >> (8 * k)) & 0xFF)];
+        }
+        return next & this->masks[c];
+    }
+
+    // Does the content match if it ends with these states active?
+    bool accepts(uint64_t active) const {
+        return (active & this->final) != 0;
+    }
+
+    // A match in progress: the active states between two bytes of content.
+    // `run` steps one of these over a whole string, and a `Matcher` keeps
+    // one between pieces of content.
+    class Cursor {
+    public:
+        Cursor(const Glushkov *automaton=nullptr, MatchMode mode=FULL_MATCH) {
+            this->automaton = automaton;
+            this->mode = mode;
+            // Searches start a new attempt at every position instead
+            this->active = mode == SEARCH? 0 : 1;
+            this->result = NO_MATCH;
+            this->finished = false;
+        }
+
+        // Is no attempt in progress?
+        bool empty() const {
+            return this->active == 0;
+        }
+
+        // The number of active states
+        int size() const {
+            return std::bitset<64>(this->active).count();
+        }
+
+        // Has the outcome been decided before the end of the content?
+        bool done() const {
+            return this->finished;
+        }
+
+        // The outcome, once `done` is true
+        MatchResult verdict() const {
+            return this->result;
+        }
+
+        // Consume `c`, returning the number of bytes consumed (none if a
+        // search turns out to have matched already)
+        int step(unsigned char c) {
+            if (this->mode == SEARCH) {
+                this->active |= 1;
+            }
+            if (this->mode != FULL_MATCH && this->automaton->accepts(this->active)) {
+                // Searches can stop as soon as anything matches
+                this->result = MATCH;
+                this->finished = true;
+                return 0;
+            }
+            this->active = this->automaton->step(this->active, c);
+            if (this->active == 0 && this->mode != SEARCH) {
+                this->finished = true;
+            }
+            return 1;
+        }
+
+        // Does the content match if it ends here?
+        bool accepts() const {
+            if (this->finished) {
+                return this->result == MATCH;
+            }
+            // A search can also match the empty string at the very end
+            return this->automaton->accepts(this->mode == SEARCH? this->active | 1 : this->active);
+        }
+
+    private:
+        const Glushkov *automaton;
+        MatchMode mode;
+        uint64_t active;
+        MatchResult result;
+        bool finished;
+    };
+
+    MatchResult run(const std::string &s, const RegexLimits &limits, RegexStats *stats=nullptr, MatchMode mode=FULL_MATCH, const Prefilter *prefilter=nullptr) const {
+        Cursor cursor(this, mode);
+        MatchResult result = NO_MATCH;
+        bool finished = false;
+
+        #ifdef STATS
+        long long scanned = 0;
+        int max_active = 1;
+        #endif
+
+        // Every byte is one step of work here
+        long long steps = 0;
+        RegexBudget budget(limits);
+
+        for (int i = 0; i < s.size() && s[i]; i++) {
+            if (mode == SEARCH && cursor.empty() && prefilter != nullptr && prefilter->enabled) {
+                // Nothing is in progress, so skip to where a match could start
+                i = prefilter->find(s, i);
+                if (i >= s.size() || !s[i]) {
+                    // The skip looked at every byte up to the end
+                    if (!budget.allows(i - 1, steps)) {
+                        result = LIMIT_EXCEEDED;
+                        finished = true;
+                    }
+                    break;
+                }
+            }
+            if (!budget.allows(i, steps)) {
+                result = LIMIT_EXCEEDED;
+                finished = true;
+                break;
+            }
+
+            int consumed = cursor.step(s[i]);
+            steps += consumed;
+            #ifdef STATS
+            scanned += consumed;
+            if (cursor.size() > max_active) {
+                max_active = cursor.size();
+            }
+            #endif
+            if (cursor.done()) {
+                result = cursor.verdict();
+                finished = true;
+                break;
+            }
+        }
+
+        #ifdef STATS
+        if (stats != nullptr) {
+            stats->bytes_scanned += scanned;
+            if (max_active > stats->max_active) {
+                stats->max_active = max_active;
+            }
+        }
+        #endif
+
+        if (finished) {
+            return result;
+        }
+        return cursor.accepts()? MATCH : NO_MATCH;
+    }
+
+private:
+    // The states that accept, including the initial state if the pattern matches nothing
+    uint64_t final;
+    // The states each byte can enter
+    std::vector<uint64_t> masks;
+    std::vector<uint64_t> follow_tables;
+    int chunks;
+};
+
+// What `post2glushkov` knows about a subexpression
+struct GlushkovPart {
+    // Does it match the empty string?
+    bool nullable;
+    // The positions it can start and end with
+    uint64_t first, last;
+
+    GlushkovPart(bool nullable, uint64_t first, uint64_t last) {
+        this->nullable = nullable;
+        this->first = first;
+        this->last = last;
+    }
+};
+
+// Every position at the end of `e1` can be followed by one at the start of `e2`
+GlushkovPart glushkov_concat(const GlushkovPart &e1, const GlushkovPart &e2, std::vector<uint64_t> &follow) {
+    for (int p = 0; p < follow.size(); p++) {
+        if ((e1.last >> p) & 1) {
+            follow[p] |= e2.first;
+        }
+    }
+    return GlushkovPart(
+        e1.nullable && e2.nullable,
+        e1.first | (e1.nullable? e2.first : 0),
+        e2.last | (e2.nullable? e1.last : 0)
+    );
+}
+
+// Build a Glushkov automaton from the same postfix as `post2nfa`.
+// Returns nullptr if the pattern has assertions or more than
+// `Glushkov::MAX_POSITIONS` positions; the NFA is used for those.
+Glushkov *post2glushkov(std::string postfix, int flags=0) {
+    std::vector<GlushkovPart> stack;
+    std::vector<uint64_t> follow(1, 0);
+    std::vector< std::bitset<256> > bytes(1);
+
+    for (int i = 0; i < postfix.size() && postfix[i]; i++) {
+        if (postfix[i] == '.' || postfix[i] == '|') {
+            if (stack.size() < 2) {
+                continue;
+            }
+            GlushkovPart e2 = stack.back();
+            stack.pop_back();
+            GlushkovPart e1 = stack.back();
+            stack.pop_back();
+            if (postfix[i] == '.') {
+                stack.push_back(glushkov_concat(e1, e2, follow));
+            } else {
+                stack.push_back(GlushkovPart(e1.nullable || e2.nullable, e1.first | e2.first, e1.last | e2.last));
+            }
+        } else if (postfix[i] == '*' || postfix[i] == '+' || postfix[i] == '?') {
+            if (stack.empty()) {
                 continue;
             }
+            GlushkovPart &e = stack.back();
+            if (postfix[i] != '?') {
+                // Loop from the end back to the start
+                glushkov_concat(e, e, follow);
+            }
+            if (postfix[i] != '+') {
+                e.nullable = true;
+            }
+        } else if (postfix[i] == '^' || postfix[i] == '$') {
+            return nullptr;
+        } else {
+            int length = atom_length(postfix, i);
+            std::string atom = postfix.substr(i, length);
+            i += length - 1;
+            if (atom == "\\b" || atom == "\\B") {
+                return nullptr;
+            }
+
+            // Every atom is an alternation of runs of byte ranges
+            std::vector<ByteSequence> sequences;
+            if (atom[0] == '[') {
+                std::vector<CodepointRange> ranges = parse_class(atom, (flags & CASE_INSENSITIVE) != 0);
+                for (int r = 0; r < ranges.size(); r++) {
+                    std::vector<ByteSequence> more = utf8_sequences(ranges[r].first, ranges[r].second);
+                    sequences.insert(sequences.end(), more.begin(), more.end());
+                }
+            } else {
+                int j = 0;
+                std::string literal = atom[0] == '\\'? encode_utf8(parse_escape(atom, j)) : atom;
+                ByteSequence sequence;
+                for (int k = 0; k < literal.size(); k++) {
+                    sequence.push_back(std::make_pair((unsigned char)literal[k], (unsigned char)literal[k]));
+                }
+                sequences.push_back(sequence);
+            }
+
+            GlushkovPart alternatives(false, 0, 0);
+            for (int k = 0; k < sequences.size(); k++) {
+                GlushkovPart run(true, 0, 0);
+                for (int b = 0; b < sequences[k].size(); b++) {
+                    int position = bytes.size();
+                    if (position > Glushkov::MAX_POSITIONS) {
+                        return nullptr;
+                    }
+                    std::bitset<256> set;
+                    for (int c = sequences[k][b].first; c <= sequences[k][b].second; c++) {
+                        set[c] = true;
+                        if ((flags & CASE_INSENSITIVE) && ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))) {
+                            set[c ^ 0x20] = true;
+                        }
+                    }
+                    bytes.push_back(set);
+                    follow.push_back(0);
+                    uint64_t bit = (uint64_t)1 << position;
+                    run = glushkov_concat(run, GlushkovPart(false, bit, bit), follow);
+                }
+                alternatives = GlushkovPart(alternatives.nullable || run.nullable, alternatives.first | run.first, alternatives.last | run.last);
+            }
+            stack.push_back(alternatives);
+        }
+    }
+
+    if (stack.size() != 1) {
+        return nullptr;
+    }
+    follow[0] = stack.back().first;
+    uint64_t final = stack.back().last | (stack.back().nullable? 1 : 0);
+    return new Glushkov(follow, bytes, final);
+}
+
+// A DFA built lazily from the NFA, one state and one transition at a time
+// as the content needs them. A DFA state is the set of NFA states reached
+// after consuming a byte, together with the class of that byte (start of
+// content, word, or non-word) when the pattern has assertions that look at it.
+// Transitions live in a flat table, so a cached step is a single lookup.
+class DFA {
+public:
+    enum {
+        // No match is possible from here on
+        DEAD = 0,
+        // A search has already found a match
+        MATCHED = 1,
+        // The number of inputs `run_batch` advances together
+        LANES = 16,
+        // The most bytes `run_batch` advances each lane before checking them
+        ROUND = 32
+    };
+
+    DFA(State *start, MatchMode mode=FULL_MATCH, size_t max_bytes=0) {
+        this->nfa = start;
+        this->mode = mode;
+        this->max_bytes = max_bytes;
+        this->has_assertions = false;
+        std::unordered_set<State *> states = start->collect_states();
+        for (std::unordered_set<State *>::iterator it = states.begin(); it != states.end(); it++) {
+            if ((*it)->is_assertion()) {
+                this->has_assertions = true;
+            }
+        }
+        this->misses = 0;
+        this->flushes = 0;
+        reset();
+    }
+
+    int start() const {
+        return this->start_state;
+    }
+
+    // The state after `state` consumes `c`, computing it if it is not cached yet
+    int next(int state, unsigned char c) {
+        int target = this->transitions[state * 256 + c];
+        return target >= 0? target : fill(state, c);
+    }
+
+    // Does `state` match if the content ends here?
+    bool accepts(int state) const {
+        return this->accepting[state];
+    }
+
+    // Has the cache grown past its memory limit? Call `flush` at the next
+    // point where every state in use can be passed to it.
+    bool full() const {
+        return this->max_bytes > 0 && this->bytes > this->max_bytes;
+    }
+
+    // Counters for `RegexStats`
+    long long cache_flushes() const {
+        return this->flushes;
+    }
+
+    long long cache_misses() const {
+        return this->misses;
+    }
+
+    // Forget every state, then rebuild the ones in `live`, updating them in place
+    void flush(std::vector<int> &live) {
+        std::vector< std::pair<std::vector<State *>, int> > keep;
+        for (int k = 0; k < live.size(); k++) {
+            keep.push_back(this->kernels[live[k]]);
+        }
+        reset();
+        this->flushes++;
+        for (int k = 0; k < live.size(); k++) {
+            if (live[k] != DEAD && live[k] != MATCHED) {
+                live[k] = intern(keep[k].first, keep[k].second);
+            }
+        }
+    }
+
+    // A match in progress: the DFA state between two bytes of content.
+    // `run` steps one of these over a whole string, and a `Matcher` keeps
+    // one between pieces of content.
+    class Cursor {
+    public:
+        Cursor(DFA *automaton=nullptr) {
+            this->automaton = automaton;
+            this->state = automaton != nullptr? automaton->start() : DEAD;
+            this->generation = automaton != nullptr? automaton->flushes : 0;
+        }
+
+        // Is no attempt in progress? Only searches come back to the start.
+        bool at_start() const {
+            return this->state == this->automaton->start_state;
+        }
+
+        // Has the outcome been decided before the end of the content?
+        bool done() const {
+            return this->state == DEAD || this->state == MATCHED;
+        }
+
+        // The outcome, once `done` is true
+        MatchResult verdict() const {
+            return this->state == MATCHED? MATCH : NO_MATCH;
+        }
+
+        // Consume `c`, flushing the cache if that fills it. Returns the
+        // number of bytes consumed.
+        int step(unsigned char c) {
+            this->state = this->automaton->next(this->state, c);
+            if (!done() && this->automaton->full()) {
+                std::vector<int> live(1, this->state);
+                this->automaton->flush(live);
+                this->state = live[0];
+            }
+            return 1;
+        }
+
+        // Does the content match if it ends here?
+        bool accepts() const {
+            return this->automaton->accepts(this->state);
+        }
+
+        // A state id means nothing after a flush, so a cursor that is kept
+        // while others use the same DFA saves the NFA states behind it.
+        // Without a memory limit the cache is never flushed.
+        void save() {
+            if (!done() && this->automaton->max_bytes > 0) {
+                this->kernel = this->automaton->kernels[this->state];
+                this->generation = this->automaton->flushes;
+            }
         }
-        last_clist = clist;
+
+        // Rebuild the state if the cache was flushed since `save`
+        void reload() {
+            if (!done() && this->automaton->flushes != this->generation) {
+                this->state = this->automaton->intern(this->kernel.first, this->kernel.second);
+                this->generation = this->automaton->flushes;
+            }
+        }
+
+    private:
+        DFA *automaton;
+        int state;
+        std::pair<std::vector<State *>, int> kernel;
+        long long generation;
+    };
+
+    MatchResult run(const std::string &s, const RegexLimits &limits, RegexStats *stats=nullptr, const Prefilter *prefilter=nullptr) {
+        Cursor cursor(this);
+        MatchResult result = NO_MATCH;
+        bool finished = false;
+        #ifdef STATS
+        long long misses_before = this->misses, flushes_before = this->flushes;
         #endif
-        std::set<State *> visited;
-        for (int j = 0; j < clist.size(); j++) {
-            State *state = clist[j];
 
+        // Every byte is one step of work here
+        long long steps = 0;
+        RegexBudget budget(limits);
+
+        int i = 0;
+        for (; i < s.size() && s[i]; i++) {
+            if (this->mode == SEARCH && cursor.at_start() && !this->has_assertions && prefilter != nullptr && prefilter->enabled) {
+                // Nothing is in progress, so skip to where a match could start
+                i = prefilter->find(s, i);
+                if (i >= s.size() || !s[i]) {
+                    // The skip looked at every byte up to the end
+                    if (!budget.allows(i - 1, steps)) {
+                        result = LIMIT_EXCEEDED;
+                        finished = true;
+                    }
+                    break;
+                }
+            }
+            if (!budget.allows(i, steps)) {
+                result = LIMIT_EXCEEDED;
+                finished = true;
+                break;
+            }
+
+            steps += cursor.step(s[i]);
+            if (cursor.done()) {
+                result = cursor.verdict();
+                finished = true;
+                break;
+            }
+        }
+
+        #ifdef STATS
+        if (stats != nullptr) {
+            stats->bytes_scanned += steps;
+            stats->cache_misses += this->misses - misses_before;
+            stats->cache_hits += steps - (this->misses - misses_before);
+            stats->cache_flushes += this->flushes - flushes_before;
+        }
+        #endif
+
+        if (finished) {
+            return result;
+        }
+        return cursor.accepts()? MATCH : NO_MATCH;
+    }
+
+    // Fully match every input, `LANES` at a time. Each round advances all
+    // lanes by the length of the shortest remaining input, so the table
+    // lookups for different inputs do not depend on each other and the
+    // processor can have many of them in flight at once.
+    // Inputs longer than `limits.max_steps` bytes do not match, and inputs still
+    // unfinished when `limits.max_time_us` runs out for the call do not match.
+    // The cache is flushed as soon as it is full, even within a round, but a
+    // flush has to keep the state of every lane in use.
+    std::vector<bool> run_batch(const std::vector<std::string> &inputs, const RegexLimits &limits, RegexStats *stats=nullptr) {
+        std::vector<bool> results(inputs.size(), false);
+        const char *cursor[LANES];
+        int states[LANES], remaining[LANES], input[LANES];
+        int lanes = 0, next_input = 0;
+        long long steps = 0;
+        #ifdef STATS
+        long long misses_before = this->misses, flushes_before = this->flushes;
+        #endif
+
+        RegexBudget budget(limits);
+
+        while (true) {
+            // Give every empty lane a new input, finishing short ones right away
+            while (lanes < LANES && next_input < inputs.size()) {
+                const std::string &s = inputs[next_input];
+                const char *end = (const char *)memchr(s.data(), 0, s.size());
+                int length = end == nullptr? s.size() : end - s.data();
+                if (limits.max_steps > 0 && length > limits.max_steps) {
+                    next_input++;
+                    continue;
+                }
+                if (length == 0) {
+                    results[next_input++] = accepts(this->start_state);
+                    continue;
+                }
+                cursor[lanes] = s.data();
+                remaining[lanes] = length;
+                input[lanes] = next_input++;
+                states[lanes] = this->start_state;
+                lanes++;
+            }
+            if (lanes == 0) {
+                break;
+            }
+
+            // Keep rounds short enough that lanes which can no longer match
+            // are retired soon after they die
+            int round = std::min(remaining[0], (int)ROUND);
+            for (int l = 1; l < lanes; l++) {
+                round = std::min(round, remaining[l]);
+            }
+
+            const int *table = this->transitions.data();
+            for (int k = 0; k < round; k++) {
+                for (int l = 0; l < lanes; l++) {
+                    int target = table[states[l] * 256 + (unsigned char)cursor[l][k]];
+                    if (target < 0) {
+                        target = fill(states[l], cursor[l][k]);
+                        states[l] = target;
+                        if (full()) {
+                            // Every lane holds a valid state between two lookups, so
+                            // flush right away rather than letting the round overshoot
+                            std::vector<int> live(states, states + lanes);
+                            flush(live);
+                            std::copy(live.begin(), live.end(), states);
+                            target = states[l];
+                        }
+                        table = this->transitions.data();
+                    }
+                    states[l] = target;
+                }
+            }
+            steps += (long long)round * lanes;
+
+            // Retire the lanes that reached the end of their input or died
+            for (int l = 0; l < lanes; l++) {
+                cursor[l] += round;
+                remaining[l] -= round;
+                if (remaining[l] == 0 || states[l] == DEAD) {
+                    results[input[l]] = remaining[l] == 0 && accepts(states[l]);
+                    lanes--;
+                    cursor[l] = cursor[lanes];
+                    remaining[l] = remaining[lanes];
+                    input[l] = input[lanes];
+                    states[l] = states[lanes];
+                    l--;
+                }
+            }
+
+            if (budget.expired()) {
+                break;
+            }
+        }
+
+        #ifdef STATS
+        if (stats != nullptr) {
+            stats->bytes_scanned += steps;
+            stats->cache_misses += this->misses - misses_before;
+            stats->cache_hits += steps - (this->misses - misses_before);
+            stats->cache_flushes += this->flushes - flushes_before;
+        }
+        #endif
+        return results;
+    }
+
+private:
+    // Forget every state but `DEAD`, `MATCHED` and the start state
+    void reset() {
+        this->ids.clear();
+        this->kernels.clear();
+        this->transitions.clear();
+        this->accepting.clear();
+        this->bytes = 0;
+
+        std::vector<State *> empty;
+        for (int k = 0; k < 2; k++) {
+            this->kernels.push_back(std::make_pair(empty, 0));
+            this->transitions.resize(this->transitions.size() + 256, k);
+            this->accepting.push_back(k == MATCHED);
+        }
+
+        std::vector<State *> initial;
+        if (this->mode != SEARCH) {
+            initial.push_back(this->nfa);
+        }
+        this->start_state = intern(initial, 0);
+    }
+
+    // A byte that stands for a whole class when checking assertions
+    static int representative(int byte_class) {
+        return byte_class == 0? -1 : byte_class == 1? 'a' : ' ';
+    }
+
+    static int classify(unsigned char c) {
+        return is_word_byte(c)? 1 : 2;
+    }
+
+    // Every NFA state reachable from `seeds` without consuming a byte,
+    // between the bytes `prev` and `next` (-1 at the edges)
+    std::vector<State *> closure(std::vector<State *> seeds, int prev, int next) const {
+        if (this->mode == SEARCH) {
+            seeds.push_back(this->nfa);
+        }
+        std::vector<State *> result;
+        std::unordered_set<State *> visited;
+        while (!seeds.empty()) {
+            State *state = seeds.back();
+            seeds.pop_back();
             if (visited.find(state) != visited.end()) {
                 continue;
             }
-
-            if (state->is_match(s[i])) {
+            visited.insert(state);
+            result.push_back(state);
+            if (state->is_epsilon() || (state->is_assertion() && state->check(prev, next))) {
                 if (state->getout1() != nullptr) {
-                    nlist.push_back(state->getout1());
+                    seeds.push_back(state->getout1());
                 }
                 if (state->getout2() != nullptr) {
-                    nlist.push_back(state->getout2());
+                    seeds.push_back(state->getout2());
                 }
-            } else if (state->is_epsilon()) {
-                visited.insert(state);
+            }
+        }
+        return result;
+    }
+
+    // The id of the DFA state for these NFA states, adding it if it is new
+    int intern(std::vector<State *> kernel, int byte_class) {
+        std::sort(kernel.begin(), kernel.end());
+        kernel.erase(std::unique(kernel.begin(), kernel.end()), kernel.end());
+        if (kernel.empty() && this->mode != SEARCH) {
+            return DEAD;
+        }
+        if (!this->has_assertions) {
+            byte_class = 0;
+        }
+
+        std::pair<std::vector<State *>, int> key(kernel, byte_class);
+        std::map< std::pair<std::vector<State *>, int>, int >::iterator found = this->ids.find(key);
+        if (found != this->ids.end()) {
+            return found->second;
+        }
+
+        int id = this->kernels.size();
+        this->ids[key] = id;
+        this->kernels.push_back(key);
+        this->transitions.resize(this->transitions.size() + 256, -1);
 
+        bool accepted = false;
+        std::vector<State *> reached = closure(kernel, representative(byte_class), -1);
+        for (int k = 0; k < reached.size(); k++) {
+            accepted = accepted || reached[k]->is_accepting();
+        }
+        this->accepting.push_back(accepted);
+
+        // The table row, plus the kernel stored in both `ids` and `kernels`
+        this->bytes += 256 * sizeof(int) + 2 * kernel.size() * sizeof(State *) + 128;
+        return id;
+    }
+
+    // Compute, cache and return the transition from `from` on `c`
+    int fill(int from, unsigned char c) {
+        this->misses++;
+        std::vector<State *> reached = closure(this->kernels[from].first, representative(this->kernels[from].second), c);
+        std::vector<State *> kernel;
+        int target = -1;
+        for (int k = 0; k < reached.size(); k++) {
+            State *state = reached[k];
+            if (this->mode != FULL_MATCH && state->is_accepting()) {
+                target = MATCHED;
+                break;
+            }
+            if (state->is_match(c)) {
                 if (state->getout1() != nullptr) {
-                    clist.push_back(state->getout1());
+                    kernel.push_back(state->getout1());
                 }
                 if (state->getout2() != nullptr) {
-                    clist.push_back(state->getout2());
+                    kernel.push_back(state->getout2());
                 }
             }
         }
-        visited.clear();
-        #ifdef CACHING
-        if (states.find(s[i]) == states.end() || (states[s[i]].should_update())) {
-            // if (states.size() > 1000) {
-            //     states.erase(states.begin());
-            // }
-            states[s[i]].update(last_clist, nlist);
+        if (target < 0) {
+            target = intern(kernel, classify(c));
         }
-        #endif
-        
-        if (nlist.empty()) {
+        this->transitions[from * 256 + c] = target;
+        return target;
+    }
+
+    State *nfa;
+    MatchMode mode;
+    bool has_assertions;
+    int start_state;
+    std::map< std::pair<std::vector<State *>, int>, int > ids;
+    std::vector< std::pair<std::vector<State *>, int> > kernels;
+    std::vector<int> transitions;
+    std::vector<bool> accepting;
+    size_t bytes, max_bytes;
+    long long misses, flushes;
+};
+
+// Matches content that arrives in pieces, such as a record read from a
+// socket, without keeping the pieces around. Get one from `Regex::matcher`
+// or `Regex::searcher`, `feed` it the content as it comes in, and call
+// `finish` when it ends. It keeps the same state as the engine behind
+// `Regex::try_match` (the bit-parallel states, the DFA state with
+// `CACHING`, or the NFA states otherwise), so it gives the same results,
+// and it knows as soon as no continuation of the content can match.
+// A matcher uses the automata of its regex, so it must not outlive it.
+class Matcher {
+public:
+    Matcher(Glushkov *glushkov, DFA *dfa, State *start, MatchMode mode, const RegexLimits &limits, RegexStats *stats=nullptr) {
+        // Use the first engine given
+        this->glushkov = glushkov;
+        this->dfa = glushkov == nullptr? dfa : nullptr;
+        if (this->glushkov != nullptr) {
+            this->bits = Glushkov::Cursor(glushkov, mode);
+        } else if (this->dfa != nullptr) {
+            this->cursor = DFA::Cursor(dfa);
+            this->cursor.save();
+        } else {
+            this->nfa = ActiveStates(start, mode);
+        }
+        this->limits = limits;
+        this->stats = stats;
+        this->prev = -1;
+        this->position = 0;
+        this->steps = 0;
+        this->outcome = NO_MATCH;
+        this->finished = false;
+    }
+
+    // Consume the next piece of content. A NUL byte ends the content, like
+    // it does for `match`. Returns false once the result is known; any
+    // content after that is ignored.
+    // `limits.max_steps` counts the bytes of the whole content, while
+    // `limits.max_time_us` applies to each call.
+    bool feed(const char *data, size_t length) {
+        if (this->finished) {
             return false;
         }
+        if (this->dfa != nullptr) {
+            this->cursor.reload();
+        }
+
+        RegexBudget budget(this->limits, this->steps);
 
-        clist = nlist;
-        nlist.clear();
+        #ifdef STATS
+        long long scanned = 0, steps_before = this->steps, misses_before = 0, flushes_before = 0;
+        int max_active = 0;
+        if (this->dfa != nullptr) {
+            misses_before = this->dfa->cache_misses();
+            flushes_before = this->dfa->cache_flushes();
+        }
+        #endif
+        for (size_t i = 0; i < length && !this->finished; i++) {
+            if (data[i] == 0) {
+                conclude();
+                break;
+            }
+            if (!budget.allows(this->position, this->steps)) {
+                decide(LIMIT_EXCEEDED);
+                break;
+            }
+
+            int work = advance((unsigned char)data[i]);
+            this->position++;
+            this->steps += work;
+            #ifdef STATS
+            scanned++;
+            if (work > max_active) {
+                max_active = work;
+            }
+            #endif
+        }
+        if (this->dfa != nullptr) {
+            this->cursor.save();
+        }
+
+        #ifdef STATS
+        if (this->stats != nullptr) {
+            this->stats->bytes_scanned += scanned;
+            if (this->dfa != nullptr) {
+                long long misses = this->dfa->cache_misses() - misses_before;
+                this->stats->cache_misses += misses;
+                this->stats->cache_hits += this->steps - steps_before - misses;
+                this->stats->cache_flushes += this->dfa->cache_flushes() - flushes_before;
+            } else if (this->glushkov == nullptr && max_active > this->stats->max_active) {
+                this->stats->max_active = max_active;
+            }
+        }
+        #endif
+
+        // Waking a coroutine may destroy this matcher, so it comes last
+        bool more = !this->finished;
+        if (this->finished) {
+            wake();
+        }
+        return more;
     }
 
-    for (std::vector<State *>::iterator it = clist.begin(); it != clist.end(); it++) {
-        if ((*it)->accept()) {
-            return true;
+    bool feed(const std::string &chunk) {
+        return feed(chunk.data(), chunk.size());
+    }
+
+    // The content has ended: decide the result and return it
+    MatchResult finish() {
+        if (this->finished) {
+            return this->outcome;
+        }
+        if (this->dfa != nullptr) {
+            this->cursor.reload();
         }
+        conclude();
+        // Waking a coroutine may destroy this matcher, so it comes last
+        MatchResult result = this->outcome;
+        wake();
+        return result;
     }
 
-    return false;
-}
+    // Is the result known?
+    bool done() const {
+        return this->finished;
+    }
+
+    // Is it certain that the content does not match, whatever comes next?
+    // A server can drop a connection as soon as this is true.
+    bool dead() const {
+        return this->finished && this->outcome == NO_MATCH;
+    }
+
+    // The result once `done` is true, and `NO_MATCH` before then
+    MatchResult verdict() const {
+        return this->outcome;
+    }
+
+    #ifdef REGEX_COROUTINES
+    // `co_await` a matcher to suspend until its result is known.
+    // The call to `feed` or `finish` that decides it resumes the
+    // coroutine before returning. Only one coroutine may wait on a
+    // matcher at a time; another one throws `std::logic_error`.
+    bool await_ready() const noexcept {
+        return this->finished;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+        if (this->waiting.handle != nullptr) {
+            throw std::logic_error("A coroutine is already waiting on this matcher");
+        }
+        this->waiting.handle = handle.address();
+    }
+
+    MatchResult await_resume() const noexcept {
+        return this->outcome;
+    }
+    #endif
+
+private:
+    // Consume one byte on whichever engine is in use, returning the work done
+    int advance(unsigned char c) {
+        int work;
+        bool decided;
+        MatchResult result;
+        if (this->glushkov != nullptr) {
+            work = this->bits.step(c);
+            decided = this->bits.done();
+            result = this->bits.verdict();
+        } else if (this->dfa != nullptr) {
+            work = this->cursor.step(c);
+            decided = this->cursor.done();
+            result = this->cursor.verdict();
+        } else {
+            work = this->nfa.step(this->prev, c);
+            decided = this->nfa.done();
+            result = this->nfa.verdict();
+        }
+        if (decided) {
+            decide(result);
+        }
+        this->prev = c;
+        return work;
+    }
+
+    // Decide the result as if the content ended here
+    void conclude() {
+        bool accepted;
+        if (this->glushkov != nullptr) {
+            accepted = this->bits.accepts();
+        } else if (this->dfa != nullptr) {
+            accepted = this->cursor.accepts();
+        } else {
+            accepted = this->nfa.accepts(this->prev);
+        }
+        decide(accepted? MATCH : NO_MATCH);
+    }
+
+    void decide(MatchResult result) {
+        this->outcome = result;
+        this->finished = true;
+    }
+
+    // Resume the coroutine waiting on this matcher, if there is one
+    void wake() {
+        #ifdef REGEX_COROUTINES
+        if (this->waiting.handle != nullptr) {
+            std::coroutine_handle<> handle = std::coroutine_handle<>::from_address(this->waiting.handle);
+            this->waiting.handle = nullptr;
+            handle.resume();
+        }
+        #endif
+    }
+
+    // The address of the coroutine awaiting the result. It is kept as a
+    // plain pointer so the class is the same with or without coroutines.
+    // The coroutine waits on one matcher, so copies start without it.
+    struct Waiter {
+        void *handle;
+
+        Waiter() {
+            this->handle = nullptr;
+        }
+
+        Waiter(const Waiter &) {
+            this->handle = nullptr;
+        }
+
+        Waiter &operator=(const Waiter &) {
+            return *this;
+        }
+    };
+
+    Glushkov *glushkov;
+    DFA *dfa;
+    RegexLimits limits;
+    RegexStats *stats;
+
+    // The state of the engine in use
+    Glushkov::Cursor bits;
+    DFA::Cursor cursor;
+    ActiveStates nfa;
+
+    // The last byte consumed, or -1 at the start
+    int prev;
+    // The bytes consumed so far, and the work that took
+    long long position, steps;
+    MatchResult outcome;
+    bool finished;
+    Waiter waiting;
+};
 
 class Regex {
 public:
-    Regex(std::string pattern) {
-        // Is pattern empty?
-        if (pattern.empty()) {
-            std::cerr << "Pattern cannot be empty" << std::endl;
-            exit(1);
-        }
+    // Compile a pattern, throwing a `RegexError` if it is invalid
+    // or if it exceeds `limits.max_states`
+    Regex(std::string pattern, RegexLimits limits=RegexLimits()) {
+        this->pattern = pattern;
+        this->flags = 0;
+        this->limits = limits;
+        compile();
+    }
 
+    // Compile a pattern with some `RegexFlags`, like `CASE_INSENSITIVE`
+    Regex(std::string pattern, int flags, RegexLimits limits=RegexLimits()) {
         this->pattern = pattern;
-        this->start = post2nfa(infix2postfix(pattern));
+        this->flags = flags;
+        this->limits = limits;
+        compile();
+    }
+
+    // Does the whole content match? A match that runs past the limits
+    // counts as no match; use `try_match` to tell the two apart.
+    bool match(const std::string &content) {
+        return try_match(content) == MATCH;
+    }
+
+    MatchResult try_match(const std::string &content) {
+        if (this->glushkov != nullptr) {
+            return this->glushkov->run(content, this->limits, &this->statistics);
+        }
+        #ifdef CACHING
+        return get_dfa()->run(content, this->limits, &this->statistics);
+        #else
+        return ::try_match(this->start, content, this->limits, &this->statistics);
+        #endif
+    }
+
+    // Match many inputs at once, interleaving them on the DFA.
+    // This gives the same results as calling `match` on each input.
+    std::vector<bool> match_batch(const std::vector<std::string> &contents) {
+        return get_dfa()->run_batch(contents, this->limits, &this->statistics);
+    }
+
+    // Does any part of the content match?
+    bool search(const std::string &content) {
+        return try_search(content) == MATCH;
     }
 
-    bool match(std::string content) {
-        return ::match(this->start, content);
+    MatchResult try_search(const std::string &content) {
+        MatchMode mode = this->anchored? ANCHORED_SEARCH : SEARCH;
+        if (this->glushkov != nullptr) {
+            return this->glushkov->run(content, this->limits, &this->statistics, mode, &this->prefilter);
+        }
+        #ifdef CACHING
+        return get_search_dfa()->run(content, this->limits, &this->statistics, &this->prefilter);
+        #else
+        return ::try_match(this->start, content, this->limits, &this->statistics, mode, &this->prefilter);
+        #endif
+    }
+
+    // Start matching content that arrives in pieces (see `Matcher`).
+    // Feeding it all of the content gives the same result as `try_match`.
+    Matcher matcher() {
+        #ifdef CACHING
+        if (this->glushkov == nullptr) {
+            return Matcher(nullptr, get_dfa(), this->start, FULL_MATCH, this->limits, &this->statistics);
+        }
+        #endif
+        return Matcher(this->glushkov, nullptr, this->start, FULL_MATCH, this->limits, &this->statistics);
+    }
+
+    // Like `matcher`, but the result is that of `try_search`
+    Matcher searcher() {
+        MatchMode mode = this->anchored? ANCHORED_SEARCH : SEARCH;
+        #ifdef CACHING
+        if (this->glushkov == nullptr) {
+            return Matcher(nullptr, get_search_dfa(), this->start, mode, this->limits, &this->statistics);
+        }
+        #endif
+        return Matcher(this->glushkov, nullptr, this->start, mode, this->limits, &this->statistics);
+    }
+
+    // Is this regex small enough to run on the bit-parallel engine?
+    bool is_bit_parallel() const {
+        return this->glushkov != nullptr;
     }
 
     Regex(const Regex &other) {
         this->pattern = other.pattern;
-        this->start = post2nfa(infix2postfix(other.pattern));
+        this->flags = other.flags;
+        this->limits = other.limits;
+        compile();
     }
 
     ~Regex() {
         debug << "Deleting regex" << std::endl;
         delete this->start;
+        delete this->glushkov;
+        delete this->dfa;
+        delete this->search_dfa;
         debug << "Deleted regex" << std::endl;
     }
 
@@ -693,17 +2743,86 @@ public:
             return *this;
         }
 
+        State *old = this->start;
+        Glushkov *old_glushkov = this->glushkov;
+        DFA *old_dfa = this->dfa, *old_search_dfa = this->search_dfa;
         this->pattern = other.pattern;
-        this->start = post2nfa(infix2postfix(other.pattern));
+        this->flags = other.flags;
+        this->limits = other.limits;
+        compile();
+        delete old;
+        delete old_glushkov;
+        delete old_dfa;
+        delete old_search_dfa;
         return *this;
     }
 
+    // The counters collected for this regex.
+    // These are all zero unless `STATS` is defined.
+    const RegexStats &stats() const {
+        return this->statistics;
+    }
+
+    // Write the compiled NFA as a Graphviz digraph
+    void dot(std::ostream &os) const {
+        nfa2dot(this->start, os);
+    }
+
     friend std::ostream &operator<<(std::ostream &os, const Regex &regex) {
         return os << *regex.start;
     }
 private:
+    // The DFA is built the first time it is needed
+    DFA *get_dfa() {
+        if (this->dfa == nullptr) {
+            this->dfa = new DFA(this->start, FULL_MATCH, this->limits.max_cache_bytes);
+        }
+        return this->dfa;
+    }
+
+    DFA *get_search_dfa() {
+        if (this->search_dfa == nullptr) {
+            this->search_dfa = new DFA(this->start, this->anchored? ANCHORED_SEARCH : SEARCH, this->limits.max_cache_bytes);
+        }
+        return this->search_dfa;
+    }
+
+    void compile() {
+        // Is pattern empty?
+        if (this->pattern.empty()) {
+            throw RegexError("Pattern cannot be empty");
+        }
+
+        this->statistics = RegexStats();
+        #ifdef STATS
+        std::chrono::high_resolution_clock::time_point start_time = std::chrono::high_resolution_clock::now();
+        #endif
+
+        std::string postfix = infix2postfix(this->pattern);
+        this->start = post2nfa(postfix, this->limits.max_states, this->flags);
+        // Short patterns without assertions run on the bit-parallel engine instead
+        this->glushkov = post2glushkov(postfix, this->flags);
+        this->dfa = nullptr;
+        this->search_dfa = nullptr;
+        this->anchored = is_anchored(this->start);
+        this->prefilter = Prefilter(this->start);
+
+        #ifdef STATS
+        std::chrono::high_resolution_clock::time_point end_time = std::chrono::high_resolution_clock::now();
+        this->statistics.compile_us = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+        this->statistics.states = this->start->collect_states().size();
+        #endif
+    }
+
     std::string pattern;
+    int flags;
     State *start;
+    Glushkov *glushkov;
+    DFA *dfa, *search_dfa;
+    bool anchored;
+    Prefilter prefilter;
+    RegexLimits limits;
+    RegexStats statistics;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,72 @@
+// Compare matching many short fields one at a time against `match_batch`.
+// `CACHING` makes `match` use the same lazy DFA as `match_batch` for patterns
+// that are too long for the bit-parallel engine, like the second one here.
+#define CACHING
+#include "regex.hpp"
+#include <chrono>
+#include <cstdlib>
+
+int main(int argc, char *argv[]) {
+    int count = argc > 1? atoi(argv[1]) : 1000000;
+
+    // Fields between 20 and 100 bytes long, most of which look like identifiers
+    std::vector<std::string> fields;
+    const char *alphabet = "abcdefghijklmnopqrstuvwxyz0123456789_-@.";
+    srand(1);
+    for (int i = 0; i < count; i++) {
+        std::string field;
+        int length = 20 + rand() % 81;
+        for (int j = 0; j < length; j++) {
+            field += alphabet[rand() % (rand() % 4 == 0? 40 : 36)];
+        }
+        fields.push_back(field);
+    }
+
+    const char *patterns[] = {
+        "[a-z0-9_]+(-[a-z0-9_]+)*",
+        "[a-z0-9_]*(alpha|bravo|charlie|delta|echo|foxtrot|golf|hotel|india|juliet|kilo|lima|mike|november|oscar|papa|quebec|romeo)[a-z0-9_]*|[a-z]+[0-9]+[a-z0-9_]*",
+    };
+    for (int p = 0; p < 2; p++) {
+        Regex r(patterns[p]);
+        std::cout << "Pattern: " << patterns[p] << std::endl;
+        std::cout << "Engine for match: " << (r.is_bit_parallel()? "bit-parallel" : "lazy DFA") << std::endl;
+
+        // Warm up the DFA so both loops measure cached transitions
+        r.match_batch(fields);
+
+        // Report the best of a few runs, since a single one is noisy
+        long long single_us = -1, batch_us = -1, single_matches = 0;
+        std::vector<bool> results;
+        for (int run = 0; run < 3; run++) {
+            std::chrono::high_resolution_clock::time_point start_time = std::chrono::high_resolution_clock::now();
+            single_matches = 0;
+            for (int i = 0; i < fields.size(); i++) {
+                single_matches += r.match(fields[i]);
+            }
+            std::chrono::high_resolution_clock::time_point end_time = std::chrono::high_resolution_clock::now();
+            long long us = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+            single_us = single_us < 0? us : std::min(single_us, us);
+
+            start_time = std::chrono::high_resolution_clock::now();
+            results = r.match_batch(fields);
+            end_time = std::chrono::high_resolution_clock::now();
+            us = std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count();
+            batch_us = batch_us < 0? us : std::min(batch_us, us);
+        }
+
+        long long batch_matches = 0;
+        for (int i = 0; i < results.size(); i++) {
+            batch_matches += results[i];
+        }
+        if (batch_matches != single_matches) {
+            std::cerr << "Batch and single results differ" << std::endl;
+            return 1;
+        }
+
+        std::cout << "Matches: " << single_matches << " of " << fields.size() << std::endl;
+        std::cout << "One at a time: " << single_us << "us" << std::endl;
+        std::cout << "Batch: " << batch_us << "us" << std::endl;
+        std::cout << "Speedup: " << (double)single_us / (batch_us > 0? batch_us : 1) << "x" << std::endl;
+    }
+    return 0;
+}
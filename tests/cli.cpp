@@ -30,12 +30,24 @@ int main(int argc, char *argv[]) {
 
     std::cout << "Pattern: " << pattern << std::endl;
     std::cout << "Compiling regex" << std::endl;
-    Regex r(pattern);
-    std::cout << "Compiled regex" << std::endl;
-    std::cout << "NFA: " << std::endl;
-    std::cout << r << std::endl;
-
-    std::cout << "Does `" << content << "` match: " << (r.match(content)? "yes" : "no") << std::endl;
+    try {
+        Regex r(pattern);
+        std::cout << "Compiled regex" << std::endl;
+        std::cout << "NFA: " << std::endl;
+        std::cout << r << std::endl;
+
+        std::cout << "Does `" << content << "` match: " << (r.match(content)? "yes" : "no") << std::endl;
+
+        if (verbose) {
+            std::cout << "Graphviz: " << std::endl;
+            r.dot(std::cout);
+            std::cout << "Stats: " << std::endl;
+            std::cout << r.stats() << std::endl;
+        }
+    } catch (const RegexError &e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -1,5 +1,77 @@
 #include "regex.hpp"
 #include <assert.h>
+#include <chrono>
+
+// A random pattern over a small alphabet, for comparing the engines
+std::string random_pattern(int depth, bool assertions=false) {
+    const char *atoms[] = {"a", "b", "c", "[ab]", "[^a]", "\\xC3\\xA9", "[a-c]", " ", "\\b", "\\B", "^", "$"};
+    if (depth == 0 || rand() % 3 == 0) {
+        return atoms[rand() % (assertions? 12 : 7)];
+    }
+    switch (rand() % 5) {
+        case 0:
+            return random_pattern(depth - 1, assertions) + random_pattern(depth - 1, assertions);
+        case 1:
+            return "(" + random_pattern(depth - 1, assertions) + "|" + random_pattern(depth - 1, assertions) + ")";
+        case 2:
+            return "(" + random_pattern(depth - 1, assertions) + ")*";
+        case 3:
+            return "(" + random_pattern(depth - 1, assertions) + ")+";
+        default:
+            return "(" + random_pattern(depth - 1, assertions) + ")?";
+    }
+}
+
+// Feed `content` to `matcher` in pieces of random sizes, then finish it
+MatchResult feed_in_pieces(Matcher matcher, const std::string &content) {
+    int i = 0;
+    while (i < content.size()) {
+        int length = rand() % 4;
+        if (!matcher.feed(content.substr(i, length))) {
+            break;
+        }
+        i += length;
+    }
+    return matcher.finish();
+}
+
+#ifdef REGEX_COROUTINES
+// A coroutine that starts right away and that nothing waits for
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() {
+            return Detached();
+        }
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+        std::suspend_never final_suspend() noexcept {
+            return {};
+        }
+        void return_void() {}
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+};
+
+// Await the result of `matcher`, or -2 if another coroutine is already waiting on it
+Detached await_verdict(Matcher &matcher, int &verdict) {
+    try {
+        verdict = co_await matcher;
+    } catch (const std::logic_error &e) {
+        verdict = -2;
+    }
+}
+
+// Await the result of a matcher that lives in the coroutine, so it is
+// destroyed as soon as the coroutine is resumed
+Detached await_own_matcher(Regex &regex, Matcher *&matcher, int &verdict) {
+    Matcher owned = regex.matcher();
+    matcher = &owned;
+    verdict = co_await owned;
+}
+#endif
 
 int main() {
     #ifdef CACHING
@@ -73,6 +145,491 @@ int main() {
         std::cout << "Average Time: " << std::chrono::duration_cast<std::chrono::microseconds>(end_time - start_time).count() / trials << "us" << std::endl;
     }
 
+    std::cout << "Instrumentation tests begin" << std::endl;
+
+    Regex instrumented("(ab)*c");
+    std::stringstream dot;
+    instrumented.dot(dot);
+    if (dot.str().find("digraph") != 0 || dot.str().find("doublecircle") == std::string::npos) {
+        std::cerr << "Failed to dump NFA as Graphviz" << std::endl;
+        return 1;
+    }
+
+    // Bytes that are not printable ASCII are written as `\xHH`, so every
+    // label stays on one line and the output is valid UTF-8
+    std::stringstream unprintable;
+    Regex("\xC3\xA9|a\n").dot(unprintable);
+    std::string unprintable_dot = unprintable.str(), line;
+    while (std::getline(unprintable, line)) {
+        for (int i = 0; i < line.size(); i++) {
+            if ((unsigned char)line[i] < ' ' || (unsigned char)line[i] >= 0x7F) {
+                std::cerr << "Unescaped byte in Graphviz output" << std::endl;
+                return 1;
+            }
+        }
+        if (line[line.size() - 1] != ';' && line[line.size() - 1] != '{' && line[line.size() - 1] != '}') {
+            std::cerr << "Graphviz label split across lines" << std::endl;
+            return 1;
+        }
+    }
+    if (unprintable_dot.find("\\\\xC3") == std::string::npos || unprintable_dot.find("\\\\x0A") == std::string::npos) {
+        std::cerr << "Expected escaped bytes in Graphviz output" << std::endl;
+        return 1;
+    }
+
+    if (!instrumented.match("ababc") || instrumented.match("abab")) {
+        std::cerr << "Failed" << std::endl;
+        return 1;
+    }
+
+    #ifdef STATS
+    std::cout << instrumented.stats() << std::endl;
+    if (instrumented.stats().states == 0 || instrumented.stats().bytes_scanned != 9 || instrumented.stats().max_active == 0) {
+        std::cerr << "Unexpected stats" << std::endl;
+        return 1;
+    }
+    #else
+    if (instrumented.stats().bytes_scanned != 0) {
+        std::cerr << "Stats should be compiled out" << std::endl;
+        return 1;
+    }
+    #endif
+
+    std::cout << "Limit tests begin" << std::endl;
+
+    const char *invalid[] = {"", "(ab", "ab)", "a(b|c))", "(a|)", "*a", "|a", "a||b", "a|", "()", "a(*b)", "+"};
+    for (int i = 0; i < 12; i++) {
+        try {
+            Regex bad(invalid[i]);
+            std::cerr << "Expected an error for `" << invalid[i] << "`" << std::endl;
+            return 1;
+        } catch (const RegexError &e) {
+            std::cout << "`" << invalid[i] << "`: " << e.what() << std::endl;
+        }
+    }
+
+    RegexLimits small;
+    small.max_states = 8;
+    try {
+        Regex big("abcdefghijklmnop", small);
+        std::cerr << "Expected the regex to be too large" << std::endl;
+        return 1;
+    } catch (const RegexError &e) {
+        std::cout << e.what() << std::endl;
+    }
+    // Every state counts against the limit, including the match state and
+    // those added when an out state has to fan out
+    std::string nested = "a?";
+    for (int depth = 0; depth < 6; depth++) {
+        nested = "(" + nested + ")+";
+        std::string postfix = infix2postfix(nested);
+        State *nfa = post2nfa(postfix);
+        int count = nfa->collect_states().size();
+        delete nfa;
+        nfa = post2nfa(postfix, count);
+        delete nfa;
+        try {
+            post2nfa(postfix, count - 1);
+            std::cerr << "Expected `" << nested << "` to need " << count << " states" << std::endl;
+            return 1;
+        } catch (const RegexError &e) {}
+    }
+
+    Regex fits("abc", small);
+    if (!fits.match("abc")) {
+        std::cerr << "Failed" << std::endl;
+        return 1;
+    }
+
+    RegexLimits budget;
+    budget.max_steps = 1000;
+    Regex bounded("(a|b|c|d)*", budget);
+    std::string long_content;
+    for (int i = 0; i < 1000; i++) {
+        long_content += "abcd";
+    }
+    if (bounded.try_match("abcd") != MATCH || bounded.try_match("abce") != NO_MATCH) {
+        std::cerr << "Failed" << std::endl;
+        return 1;
+    }
+    if (bounded.try_match(long_content) != LIMIT_EXCEEDED || bounded.match(long_content)) {
+        std::cerr << "Expected the step budget to be exceeded" << std::endl;
+        return 1;
+    }
+
+    // `max_steps` counts bytes on every engine, so exactly `max_steps` bytes fit
+    Regex per_byte("(a|b|c|d)*", budget);
+    std::vector<std::string> at_limit;
+    at_limit.push_back(std::string(1000, 'a'));
+    at_limit.push_back(std::string(1001, 'a'));
+    std::vector<bool> batch_at_limit = per_byte.match_batch(at_limit);
+    if (per_byte.try_match(at_limit[0]) != MATCH || per_byte.try_match(at_limit[1]) != LIMIT_EXCEEDED
+        || batch_at_limit[0] != per_byte.match(at_limit[0]) || batch_at_limit[1] != per_byte.match(at_limit[1])) {
+        std::cerr << "Expected the step budget to allow exactly `max_steps` bytes" << std::endl;
+        return 1;
+    }
+
+    // The same holds for a pattern too long for the bit-parallel engine,
+    // which runs on the NFA (or the DFA with `CACHING`)
+    RegexLimits hundred_bytes;
+    hundred_bytes.max_steps = 100;
+    Regex long_limited("(a|b)*" + std::string(70, 'a'), hundred_bytes);
+    std::vector<std::string> around_limit;
+    around_limit.push_back(std::string(80, 'a'));
+    around_limit.push_back(std::string(100, 'a'));
+    around_limit.push_back(std::string(101, 'a'));
+    std::vector<bool> batch_around_limit = long_limited.match_batch(around_limit);
+    if (long_limited.is_bit_parallel() || long_limited.try_match(around_limit[0]) != MATCH
+        || long_limited.try_match(around_limit[1]) != MATCH || long_limited.try_match(around_limit[2]) != LIMIT_EXCEEDED) {
+        std::cerr << "Expected the step budget to count bytes on the NFA" << std::endl;
+        return 1;
+    }
+    for (int i = 0; i < around_limit.size(); i++) {
+        if (batch_around_limit[i] != long_limited.match(around_limit[i])) {
+            std::cerr << "Batch disagrees with match at the step budget" << std::endl;
+            return 1;
+        }
+    }
+    // Searches count the bytes the prefilter skips, so they stop at the same place
+    Regex long_search("\\b" + std::string(70, 'a') + "b", hundred_bytes);
+    std::string skipped(90, ' ');
+    if (long_search.try_search(skipped + std::string(70, 'a') + "b") != LIMIT_EXCEEDED
+        || long_search.try_search(std::string(20, ' ') + std::string(70, 'a') + "b") != MATCH
+        || long_search.try_search(std::string(100, ' ')) != NO_MATCH
+        || long_search.try_search(std::string(101, ' ')) != LIMIT_EXCEEDED) {
+        std::cerr << "Expected searches to count skipped bytes" << std::endl;
+        return 1;
+    }
+
+    RegexLimits deadline;
+    deadline.max_time_us = 1;
+    Regex timed("(a|b|c|d)*", deadline);
+    for (int i = 0; i < 6; i++) {
+        long_content += long_content;
+    }
+    if (timed.try_match(long_content) != LIMIT_EXCEEDED) {
+        std::cerr << "Expected the deadline to pass" << std::endl;
+        return 1;
+    }
+
+    std::cout << "Assertion tests begin" << std::endl;
+
+    struct {
+        const char *pattern, *content;
+        bool matches, found;
+    } assertions[] = {
+        {"^ab$", "ab", true, true},
+        {"^ab$", "xab", false, false},
+        {"^ab", "abx", false, true},
+        {"ab$", "xab", false, true},
+        {"\\bcat\\b", "a cat!", false, true},
+        {"\\bcat\\b", "concat", false, false},
+        {"\\bcat\\b", "cats", false, false},
+        {"a\\Bb", "ab", true, true},
+        {"a\\bb", "ab", false, false},
+        {"^a|b", "xb", false, true},
+        {"^a|b", "xa", false, false},
+        {"$", "", true, true},
+        {"(ab)c", "abc", true, true},
+        {"a*(b)", "aab", true, true},
+        {"\\(a\\)", "x(a)", false, true},
+    };
+    for (int i = 0; i < sizeof(assertions) / sizeof(assertions[0]); i++) {
+        Regex r(assertions[i].pattern);
+        if (r.match(assertions[i].content) != assertions[i].matches || r.search(assertions[i].content) != assertions[i].found) {
+            std::cerr << "Failed `" << assertions[i].pattern << "` on `" << assertions[i].content << "`" << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << "UTF-8 tests begin" << std::endl;
+
+    struct {
+        const char *pattern, *content;
+        bool matches, found;
+    } unicode[] = {
+        {"[^\\x00-\\x7F]+", "h\xC3\xA9llo", false, true},
+        {"[^\\x00-\\x7F]+", "hello", false, false},
+        {"[^\\x00-\\x7F]+", "\xE6\x97\xA5\xE6\x9C\xAC", true, true},
+        {"\xC3\xA9+", "\xC3\xA9\xC3\xA9", true, true},
+        {"\xC3\xA9+", "\xC3\xA9\xA9", false, true},
+        {"[\xCE\xB1-\xCF\x89]+", "\xCE\xB1\xCE\xB2\xCE\xB3", true, true},
+        {"[^a]", "\xF0\x9F\x98\x80", true, true},
+        {"[^a]", "\xC3", false, false},
+        {"\\x{1F600}", "\xF0\x9F\x98\x80", true, true},
+        {"[\\x{800}-\\x{FFFF}]", "\xC3\xA9", false, false},
+        {"[a-c\\-]*", "a-c", true, true},
+    };
+    for (int i = 0; i < sizeof(unicode) / sizeof(unicode[0]); i++) {
+        Regex r(unicode[i].pattern);
+        if (r.match(unicode[i].content) != unicode[i].matches || r.search(unicode[i].content) != unicode[i].found) {
+            std::cerr << "Failed `" << unicode[i].pattern << "` on `" << unicode[i].content << "`" << std::endl;
+            return 1;
+        }
+    }
+
+    const char *invalid_classes[] = {"[z-a]", "[abc", "[]", "\\x4", "\\x{110000}"};
+    for (int i = 0; i < 5; i++) {
+        try {
+            Regex bad(invalid_classes[i]);
+            std::cerr << "Expected an error for `" << invalid_classes[i] << "`" << std::endl;
+            return 1;
+        } catch (const RegexError &e) {
+        }
+    }
+
+    std::cout << "Case-insensitive tests begin" << std::endl;
+
+    struct {
+        const char *pattern, *content;
+        bool matches, found;
+    } folded[] = {
+        {"hello", "HeLLo", true, true},
+        {"hello", "say HELLO!", false, true},
+        {"(ab)+c", "aBAbC", true, true},
+        {"[a-c]+", "AbC", true, true},
+        {"[^a-c]", "B", false, false},
+        {"[^a-c]", "d", true, true},
+        {"[X-c]+", "xyZaBC", true, true},
+        {"\\bword\\b", "a WORD here", false, true},
+        {"\\x41", "a", true, true},
+        {"1+", "111", true, true},
+    };
+    for (int i = 0; i < sizeof(folded) / sizeof(folded[0]); i++) {
+        Regex r(folded[i].pattern, CASE_INSENSITIVE);
+        if (r.match(folded[i].content) != folded[i].matches || r.search(folded[i].content) != folded[i].found) {
+            std::cerr << "Failed `" << folded[i].pattern << "` on `" << folded[i].content << "`" << std::endl;
+            return 1;
+        }
+    }
+    if (Regex("hello").search("HELLO")) {
+        std::cerr << "Matching should be case sensitive by default" << std::endl;
+        return 1;
+    }
+
+    // Searching long content exercises the prefilter
+    std::string haystack;
+    for (int i = 0; i < 1000; i++) {
+        haystack += "the quick brown fox jumps over the lazy dog ";
+    }
+    Regex needle("Zebra|zoo", CASE_INSENSITIVE);
+    if (needle.search(haystack) || !needle.search(haystack + "ZOO") || !needle.search(haystack + "zEbRa")) {
+        std::cerr << "Failed to search long content" << std::endl;
+        return 1;
+    }
+
+    std::cout << "Bit-parallel tests begin" << std::endl;
+
+    if (!Regex("(a|b)*c").is_bit_parallel() || Regex("^ab").is_bit_parallel() || Regex("[^\\x00-\\x7F]+").is_bit_parallel() == false) {
+        std::cerr << "Wrong engine chosen" << std::endl;
+        return 1;
+    }
+    std::string long_literal(100, 'a');
+    if (Regex(long_literal).is_bit_parallel() || !Regex(long_literal).match(long_literal)) {
+        std::cerr << "Long patterns should fall back to the NFA" << std::endl;
+        return 1;
+    }
+
+    // The bit-parallel engine must agree with the NFA
+    srand(42);
+    const char *pieces[] = {"a", "b", "c", "\xC3\xA9", "\xC3"};
+    for (int trial = 0; trial < 2000; trial++) {
+        std::string pattern = random_pattern(4);
+        std::string postfix = infix2postfix(pattern);
+        Glushkov *glushkov = post2glushkov(postfix);
+        if (glushkov == nullptr) {
+            continue;
+        }
+        State *nfa = post2nfa(postfix);
+        for (int k = 0; k < 20; k++) {
+            std::string content;
+            int length = rand() % 8;
+            for (int j = 0; j < length; j++) {
+                content += pieces[rand() % 5];
+            }
+            for (int mode = FULL_MATCH; mode <= SEARCH; mode++) {
+                if (glushkov->run(content, RegexLimits(), nullptr, (MatchMode)mode) != try_match(nfa, content, RegexLimits(), nullptr, (MatchMode)mode)) {
+                    std::cerr << "Engines disagree on `" << pattern << "` with `" << content << "`" << std::endl;
+                    return 1;
+                }
+            }
+        }
+        delete nfa;
+        delete glushkov;
+    }
+
+    std::cout << "DFA tests begin" << std::endl;
+
+    // The lazy DFA must agree with the NFA, even when it is flushed after every step
+    const char *spaced[] = {"a", "b", " ", "\xC3\xA9", "c"};
+    for (int trial = 0; trial < 1000; trial++) {
+        std::string pattern = random_pattern(4, true);
+        State *nfa = post2nfa(infix2postfix(pattern));
+        for (int mode = FULL_MATCH; mode <= ANCHORED_SEARCH; mode++) {
+            DFA dfa(nfa, (MatchMode)mode), tiny(nfa, (MatchMode)mode, 1);
+            for (int k = 0; k < 10; k++) {
+                std::string content;
+                int length = rand() % 8;
+                for (int j = 0; j < length; j++) {
+                    content += spaced[rand() % 5];
+                }
+                MatchResult expected = try_match(nfa, content, RegexLimits(), nullptr, (MatchMode)mode);
+                if (dfa.run(content, RegexLimits()) != expected || tiny.run(content, RegexLimits()) != expected) {
+                    std::cerr << "DFA disagrees on `" << pattern << "` with `" << content << "`" << std::endl;
+                    return 1;
+                }
+            }
+        }
+        delete nfa;
+    }
+
+    std::cout << "Batch tests begin" << std::endl;
+
+    const char *batch_patterns[] = {"(a|b)*c", "\\bab", "[^\\x00-\\x7F]+|(ab)*", "(a|b|c|d)*abcd(a|b|c|d)*"};
+    std::vector<std::string> fields;
+    for (int i = 0; i < 300; i++) {
+        std::string field;
+        int length = rand() % 40;
+        for (int j = 0; j < length; j++) {
+            field += spaced[rand() % 5];
+        }
+        fields.push_back(field);
+    }
+    fields.push_back("abcd");
+    fields.push_back("ababc");
+    for (int i = 0; i < 4; i++) {
+        RegexLimits tiny_cache;
+        tiny_cache.max_cache_bytes = 2048;
+        Regex r(batch_patterns[i]), flushed(batch_patterns[i], tiny_cache);
+        std::vector<bool> results = r.match_batch(fields), flushed_results = flushed.match_batch(fields);
+        for (int j = 0; j < fields.size(); j++) {
+            if (results[j] != r.match(fields[j]) || flushed_results[j] != results[j]) {
+                std::cerr << "Batch disagrees on `" << batch_patterns[i] << "` with `" << fields[j] << "`" << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    std::cout << "Incremental tests begin" << std::endl;
+
+    // Content fed in pieces gets the same result as all at once, including
+    // when another matcher flushes the DFA in between
+    const char *incremental_patterns[] = {"(a|b)*c", "\\bab", "[^\\x00-\\x7F]+|(ab)*", "(a|b|c|d)*abcd(a|b|c|d)*", "c$", "^a"};
+    for (int i = 0; i < 6; i++) {
+        RegexLimits tiny_cache;
+        tiny_cache.max_cache_bytes = 2048;
+        Regex r(incremental_patterns[i]), flushed(incremental_patterns[i], tiny_cache);
+        for (int j = 0; j < fields.size(); j++) {
+            if (feed_in_pieces(r.matcher(), fields[j]) != r.try_match(fields[j])
+                || feed_in_pieces(r.searcher(), fields[j]) != r.try_search(fields[j])) {
+                std::cerr << "Matcher disagrees on `" << incremental_patterns[i] << "` with `" << fields[j] << "`" << std::endl;
+                return 1;
+            }
+
+            Matcher first = flushed.matcher(), second = flushed.matcher();
+            const std::string &other = fields[(j + 1) % fields.size()];
+            for (int k = 0; k < std::max(fields[j].size(), other.size()); k++) {
+                if (k < fields[j].size()) {
+                    first.feed(fields[j].substr(k, 1));
+                }
+                if (k < other.size()) {
+                    second.feed(other.substr(k, 1));
+                }
+            }
+            if (first.finish() != r.try_match(fields[j]) || second.finish() != r.try_match(other)) {
+                std::cerr << "Flushed matcher disagrees on `" << incremental_patterns[i] << "` with `" << fields[j] << "`" << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    // The result is known as soon as the content cannot match, or as soon as a search finds something
+    Regex keyword("hello (world|there)"), unbounded("(a|b)*c"), long_pattern("(alpha|bravo|charlie|delta|echo|foxtrot|golf|hotel|india|juliet)+!");
+    Matcher greeting = keyword.matcher();
+    if (!greeting.feed("hello ") || greeting.done() || greeting.feed("wor1d") || !greeting.dead() || greeting.finish() != NO_MATCH) {
+        std::cerr << "Expected the matcher to die at `1`" << std::endl;
+        return 1;
+    }
+    Matcher found = unbounded.searcher();
+    if (!found.feed("xxab") || found.feed("cab") || found.dead() || found.verdict() != MATCH) {
+        std::cerr << "Expected the searcher to stop at the first match" << std::endl;
+        return 1;
+    }
+    Matcher spelled = long_pattern.matcher(), exclaimed = long_pattern.matcher();
+    if (!spelled.feed("alphabra") || !spelled.feed("voecho") || spelled.done() || spelled.feed("x") || !spelled.dead()
+        || !exclaimed.feed("golf!") || exclaimed.finish() != MATCH) {
+        std::cerr << "Failed" << std::endl;
+        return 1;
+    }
+    // A NUL ends the content, like it does for `match`
+    Matcher ended = unbounded.matcher();
+    if (ended.feed(std::string("abc\0d", 5)) || ended.verdict() != MATCH) {
+        std::cerr << "Expected a NUL to end the content" << std::endl;
+        return 1;
+    }
+
+    // The step limit covers all of the pieces
+    RegexLimits few_steps;
+    few_steps.max_steps = 10;
+    Regex limited("(a|b)*c", few_steps);
+    Matcher out_of_steps = limited.matcher();
+    if (!out_of_steps.feed("ababab") || out_of_steps.feed("ababab") || out_of_steps.verdict() != LIMIT_EXCEEDED || out_of_steps.dead()) {
+        std::cerr << "Expected the step budget to be exceeded" << std::endl;
+        return 1;
+    }
+
+    #ifdef REGEX_COROUTINES
+    // A coroutine awaiting a matcher is resumed by the piece that decides it
+    int verdict = -1;
+    Matcher awaited = keyword.matcher();
+    await_verdict(awaited, verdict);
+    awaited.feed("hello th");
+    awaited.feed("ere");
+    if (verdict != -1 || awaited.finish() != MATCH || verdict != MATCH) {
+        std::cerr << "Expected the coroutine to resume when the content ends" << std::endl;
+        return 1;
+    }
+    verdict = -1;
+    Matcher rejected = keyword.matcher();
+    await_verdict(rejected, verdict);
+    rejected.feed("help");
+    if (verdict != NO_MATCH) {
+        std::cerr << "Expected the coroutine to resume when the content cannot match" << std::endl;
+        return 1;
+    }
+    // One that is already decided does not suspend
+    verdict = -1;
+    await_verdict(rejected, verdict);
+    if (verdict != NO_MATCH) {
+        std::cerr << "Expected the coroutine not to suspend" << std::endl;
+        return 1;
+    }
+
+    // A copy of an awaited matcher does not resume the coroutine, and
+    // a second coroutine cannot wait on the same matcher
+    verdict = -1;
+    int second = -1;
+    Matcher original = keyword.matcher();
+    await_verdict(original, verdict);
+    await_verdict(original, second);
+    Matcher copy = original;
+    copy.feed("help");
+    if (verdict != -1 || second != -2 || original.feed("help") || verdict != NO_MATCH) {
+        std::cerr << "Expected only the awaited matcher to resume its coroutine" << std::endl;
+        return 1;
+    }
+
+    // The matcher may be destroyed by the coroutine it resumes
+    Matcher *owned = nullptr;
+    verdict = -1;
+    await_own_matcher(keyword, owned, verdict);
+    owned->feed("hello the");
+    if (owned->finish() != NO_MATCH || verdict != NO_MATCH) {
+        std::cerr << "Expected the result of a matcher owned by the coroutine" << std::endl;
+        return 1;
+    }
+    #endif
+
     std::cout << "All tests passed" << std::endl;
     return 0;
 }
\ No newline at end of file